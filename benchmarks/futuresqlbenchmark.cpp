@@ -0,0 +1,192 @@
+// SPDX-FileCopyrightText: 2022 Jonah Brüchert <jbb@kaidan.im>
+//
+// SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only
+
+#include <QTest>
+#include <QTemporaryDir>
+#include <QThread>
+
+#include <threadeddatabase.h>
+
+struct BenchmarkRow {
+    using ColumnTypes = std::tuple<int, int, QString>;
+
+    int id;
+    int value;
+    QString payload;
+};
+
+// The futures are waited for synchronously, so each iteration measures a full round trip through the database thread
+class FutureSqlBenchmark : public QObject {
+    Q_OBJECT
+
+    std::unique_ptr<ThreadedDatabase> openDatabase(bool inMemory, int readConnections = 0) {
+        DatabaseConfiguration cfg;
+        cfg.setType(DATABASE_TYPE_SQLITE);
+        if (inMemory) {
+            cfg.setDatabaseName(QStringLiteral(":memory:"));
+        } else {
+            cfg.setDatabaseName(m_dir.filePath(QStringLiteral("benchmark-%1.sqlite").arg(m_databaseCount++)));
+        }
+        cfg.setReadConnectionCount(readConnections);
+        auto db = ThreadedDatabase::establishConnection(cfg);
+
+        db->execute(QStringLiteral("CREATE TABLE bench (id INTEGER PRIMARY KEY NOT NULL, value INTEGER, payload TEXT)")).waitForFinished();
+        return db;
+    }
+
+    static void fill(ThreadedDatabase &db, int rowCount, int payloadSize) {
+        const QString payload(payloadSize, u'x');
+        std::vector<std::tuple<int, QString>> rows;
+        rows.reserve(rowCount);
+        for (int i = 0; i < rowCount; i++) {
+            rows.emplace_back(i, payload);
+        }
+        db.executeBatch(QStringLiteral("INSERT INTO bench (value, payload) VALUES (?, ?)"), std::move(rows)).waitForFinished();
+    }
+
+private Q_SLOTS:
+    void initTestCase() {
+        QVERIFY(m_dir.isValid());
+    }
+
+    // Latency of fetching a single row by its primary key
+    void getResult_data() {
+        QTest::addColumn<bool>("inMemory");
+        QTest::newRow("memory") << true;
+        QTest::newRow("disk") << false;
+    }
+
+    void getResult() {
+        QFETCH(bool, inMemory);
+        auto db = openDatabase(inMemory);
+        fill(*db, 1000, 32);
+
+        int id = 0;
+        QBENCHMARK {
+            auto future = db->getResult<BenchmarkRow>(QStringLiteral("SELECT * FROM bench WHERE id = ?"), id++ % 1000 + 1);
+            future.waitForFinished();
+        }
+    }
+
+    // Throughput of fetching and deserializing many rows
+    void getResults_data() {
+        QTest::addColumn<bool>("inMemory");
+        QTest::addColumn<int>("rowCount");
+        QTest::addColumn<int>("payloadSize");
+
+        for (const bool inMemory : {true, false}) {
+            const auto storage = inMemory ? "memory" : "disk";
+            for (const int rowCount : {10, 1000, 100000}) {
+                for (const int payloadSize : {16, 256}) {
+                    QTest::addRow("%s-%d-rows-%d-bytes", storage, rowCount, payloadSize) << inMemory << rowCount << payloadSize;
+                }
+            }
+        }
+    }
+
+    void getResults() {
+        QFETCH(bool, inMemory);
+        QFETCH(int, rowCount);
+        QFETCH(int, payloadSize);
+        auto db = openDatabase(inMemory);
+        fill(*db, rowCount, payloadSize);
+
+        QBENCHMARK {
+            auto future = db->getResults<BenchmarkRow>(QStringLiteral("SELECT * FROM bench"));
+            future.waitForFinished();
+        }
+    }
+
+    // Rate of inserting rows, each in its own transaction or all of them in one
+    void execute_data() {
+        QTest::addColumn<bool>("inMemory");
+        QTest::addColumn<bool>("transaction");
+
+        for (const bool inMemory : {true, false}) {
+            const auto storage = inMemory ? "memory" : "disk";
+            QTest::addRow("%s-autocommit", storage) << inMemory << false;
+            QTest::addRow("%s-transaction", storage) << inMemory << true;
+        }
+    }
+
+    void execute() {
+        QFETCH(bool, inMemory);
+        QFETCH(bool, transaction);
+        auto db = openDatabase(inMemory);
+        constexpr int rowCount = 100;
+
+        if (transaction) {
+            QBENCHMARK {
+                db->transaction([](Transaction &transaction) {
+                    for (int i = 0; i < rowCount; i++) {
+                        transaction.execute(QStringLiteral("INSERT INTO bench (value, payload) VALUES (?, ?)"), i, QStringLiteral("payload"));
+                    }
+                }).waitForFinished();
+            }
+        } else {
+            QBENCHMARK {
+                QFuture<void> last;
+                for (int i = 0; i < rowCount; i++) {
+                    last = db->execute(QStringLiteral("INSERT INTO bench (value, payload) VALUES (?, ?)"), i, QStringLiteral("payload"));
+                }
+                last.waitForFinished();
+            }
+        }
+    }
+
+    // Overhead of passing a job to the database thread and getting its result back, with a query that does almost nothing
+    void roundTrip() {
+        auto db = openDatabase(true);
+
+        QBENCHMARK {
+            db->getResult<SingleValue<int>>(QStringLiteral("SELECT 1")).waitForFinished();
+        }
+    }
+
+    // Several threads submitting queries at the same time
+    void producerThreads_data() {
+        QTest::addColumn<bool>("inMemory");
+        QTest::addColumn<int>("threadCount");
+        QTest::addColumn<int>("readConnections");
+
+        for (const int threadCount : {1, 4, 16}) {
+            QTest::addRow("memory-%d-threads", threadCount) << true << threadCount << 0;
+            QTest::addRow("disk-%d-threads", threadCount) << false << threadCount << 0;
+            QTest::addRow("disk-%d-threads-4-readers", threadCount) << false << threadCount << 4;
+        }
+    }
+
+    void producerThreads() {
+        QFETCH(bool, inMemory);
+        QFETCH(int, threadCount);
+        QFETCH(int, readConnections);
+        auto db = openDatabase(inMemory, readConnections);
+        fill(*db, 1000, 32);
+        constexpr int queriesPerThread = 100;
+
+        QBENCHMARK {
+            std::vector<std::unique_ptr<QThread>> threads;
+            for (int i = 0; i < threadCount; i++) {
+                threads.emplace_back(QThread::create([&db, i] {
+                    for (int j = 0; j < queriesPerThread; j++) {
+                        db->getResult<BenchmarkRow>(QStringLiteral("SELECT * FROM bench WHERE id = ?"), (i * queriesPerThread + j) % 1000 + 1)
+                            .waitForFinished();
+                    }
+                }));
+                threads.back()->start();
+            }
+            for (auto &thread : threads) {
+                thread->wait();
+            }
+        }
+    }
+
+private:
+    QTemporaryDir m_dir;
+    int m_databaseCount = 0;
+};
+
+QTEST_GUILESS_MAIN(FutureSqlBenchmark)
+
+#include "futuresqlbenchmark.moc"
@@ -23,17 +23,6 @@
 // STL
 #include <tuple>
 
-// Why is this function not part of the library, I hear you ask.
-// Currently, FutureSQL should not hard-depend on QCoro,
-// even though with Qt5, QCoro is the only way to use it without
-// hand-crafting helper functions to deal with QFutures.
-template <typename Func>
-QCoro::Task<> transaction(std::unique_ptr<ThreadedDatabase> &database, Func queryFunc) {
-    co_await database->execute("BEGIN TRANSACTION");
-    co_await queryFunc();
-    co_await database->execute("COMMIT");
-}
-
 struct HelloWorld {
     using ColumnTypes = std::tuple<int, QString>;
 
@@ -52,15 +41,22 @@ QCoro::Task<> databaseExample() {
     // Here we open the database file, and get a handle to the database.
     auto database = ThreadedDatabase::establishConnection(config);
 
-    // Run the following steps in a transaction
-    co_await transaction(database, [&database]() -> QCoro::Task<> {
+    // Run the following steps in a transaction.
+    // The function runs on the database thread, so the queries are executed synchronously,
+    // and no other queries can run in between.
+    // If one of them fails, the transaction is rolled back.
+    const bool committed = co_await database->transaction([](Transaction &transaction) {
         // Create the table
-        co_await database->execute("CREATE TABLE IF NOT EXISTS test (id INTEGER PRIMARY KEY AUTOINCREMENT, data TEXT)");
+        transaction.execute("CREATE TABLE IF NOT EXISTS test (id INTEGER PRIMARY KEY AUTOINCREMENT, data TEXT)");
 
         // Insert some initial data
-        co_await database->execute("INSERT INTO test (data) VALUES (?)", QStringLiteral("Hello World"));
+        transaction.execute("INSERT INTO test (data) VALUES (?)", QStringLiteral("Hello World"));
     });
 
+    if (!committed) {
+        qDebug() << "The transaction was rolled back";
+    }
+
     // Retrieve some data from the database.
     // The data is directly returned as our HelloWorld struct.
     auto results = co_await database->getResults<HelloWorld>("SELECT * FROM test");
@@ -0,0 +1,74 @@
+// SPDX-FileCopyrightText: 2022 Jonah Brüchert <jbb@kaidan.im>
+//
+// SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only
+
+#include "shardeddatabase.h"
+
+#include <atomic>
+
+struct ShardedDatabasePrivate {
+    std::vector<std::unique_ptr<ThreadedDatabase>> shards;
+};
+
+std::unique_ptr<ShardedDatabase> ShardedDatabase::establishConnections(const std::vector<DatabaseConfiguration> &configurations) {
+    Q_ASSERT(!configurations.empty());
+
+    auto database = std::make_unique<ShardedDatabase>();
+    database->d->shards.reserve(configurations.size());
+    for (const auto &configuration : configurations) {
+        database->d->shards.push_back(ThreadedDatabase::establishConnection(configuration));
+    }
+    return database;
+}
+
+std::size_t ShardedDatabase::shardCount() const
+{
+    return d->shards.size();
+}
+
+std::size_t ShardedDatabase::shardIndex(const QVariant &shardKey) const
+{
+    // FNV-1a, unlike qHash it is the same in every Qt version and process,
+    // so keys keep belonging to the shard that their rows were written to.
+    const QByteArray key = shardKey.toString().toUtf8();
+    quint64 hash = 14695981039346656037ULL;
+    for (const char byte : key) {
+        hash ^= quint8(byte);
+        hash *= 1099511628211ULL;
+    }
+    return std::size_t(hash % d->shards.size());
+}
+
+ThreadedDatabase &ShardedDatabase::shard(std::size_t index)
+{
+    return *d->shards[index];
+}
+
+auto ShardedDatabase::runMigrations(const QString &migrationDirectory) -> QFuture<void> {
+    auto interface = std::make_shared<QFutureInterface<void>>();
+    auto remaining = std::make_shared<std::atomic_size_t>(d->shards.size());
+    auto rejected = std::make_shared<std::atomic_bool>(false);
+    interface->reportStarted();
+
+    for (const auto &shard : d->shards) {
+        shard->db().runMigrations(nullptr, [interface, remaining] {
+            if (--*remaining == 0) {
+                interface->reportFinished();
+            }
+        }, migrationDirectory, [interface, rejected] {
+            // The other shards may still be migrated, but not all of them
+            if (!rejected->exchange(true)) {
+                interface->reportCanceled();
+                interface->reportFinished();
+            }
+        });
+    }
+    return interface->future();
+}
+
+ShardedDatabase::ShardedDatabase()
+    : d(std::make_unique<ShardedDatabasePrivate>())
+{
+}
+
+ShardedDatabase::~ShardedDatabase() = default;
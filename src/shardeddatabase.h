@@ -0,0 +1,207 @@
+// SPDX-FileCopyrightText: 2022 Jonah Brüchert <jbb@kaidan.im>
+//
+// SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only
+
+#pragma once
+
+#include <QFutureInterface>
+#include <QVariant>
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "threadeddatabase.h"
+
+#include <futuresql_export.h>
+
+///
+/// \brief How ShardedDatabase::getResults combines the rows of the shards
+///
+template <typename T>
+struct MergeOptions {
+    /// Orders the merged rows. The query must return the rows of each shard in the same order, using ORDER BY.
+    /// Without it, the rows are in the order of the shards.
+    std::function<bool (const T &, const T &)> lessThan;
+    /// Maximum number of merged rows. Adding the same LIMIT to the query saves fetching rows that are dropped.
+    std::optional<std::size_t> limit;
+};
+
+namespace asyncdatabase_private {
+
+// Collects the rows of all shards, the last shard to finish merges them
+template <typename T>
+struct ShardedResults {
+    std::mutex mutex;
+    std::vector<std::vector<T>> shards;
+    std::size_t remaining = 0;
+    bool rejected = false;
+    MergeOptions<T> options;
+    QFutureInterface<std::vector<T>> interface;
+
+    void finishShard(std::size_t index, std::vector<T> &&rows) {
+        {
+            std::lock_guard lock(mutex);
+            if (rejected) {
+                return;
+            }
+            shards[index] = std::move(rows);
+            if (--remaining > 0) {
+                return;
+            }
+        }
+
+        std::vector<T> merged;
+        std::size_t size = 0;
+        for (const auto &shard : shards) {
+            size += shard.size();
+        }
+        merged.reserve(size);
+
+        for (auto &shard : shards) {
+            const auto middle = merged.size();
+            std::move(shard.begin(), shard.end(), std::back_inserter(merged));
+            if (options.lessThan) {
+                std::inplace_merge(merged.begin(), merged.begin() + middle, merged.end(), options.lessThan);
+            }
+        }
+        shards.clear();
+
+        if (options.limit && merged.size() > *options.limit) {
+            merged.erase(merged.begin() + *options.limit, merged.end());
+        }
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        interface.reportAndMoveResult(std::move(merged));
+#else
+        // Qt 5 always copies the result into the future
+        interface.reportResult(merged);
+#endif
+        interface.reportFinished();
+    }
+
+    // A shard with a full queue rejected the query, so the results would be incomplete
+    void rejectShard() {
+        {
+            std::lock_guard lock(mutex);
+            if (std::exchange(rejected, true)) {
+                return;
+            }
+            shards.clear();
+        }
+
+        interface.reportCanceled();
+        interface.reportFinished();
+    }
+};
+
+}
+
+struct ShardedDatabasePrivate;
+
+///
+/// Spreads the rows of a database over several databases, usually in different files, that each have their own thread.
+///
+/// Queries that concern one row run on the shard of its key, so writes to different shards run in parallel.
+/// Queries for all rows run on every shard, and their results are merged.
+/// All shards have the same schema, created by runMigrations.
+///
+class FUTURESQL_EXPORT ShardedDatabase {
+public:
+    ///
+    /// \brief Connect to one database per configuration
+    /// \param configurations of the shards. Their order decides which keys belong to which shard,
+    ///        so it must stay the same whenever the databases are opened.
+    ///
+    static std::unique_ptr<ShardedDatabase> establishConnections(const std::vector<DatabaseConfiguration> &configurations);
+
+    ///
+    /// \brief Number of shards
+    ///
+    std::size_t shardCount() const;
+
+    ///
+    /// \brief The index of the shard that a key belongs to.
+    ///
+    /// It only depends on the text of the key and the number of shards.
+    ///
+    std::size_t shardIndex(const QVariant &shardKey) const;
+
+    ///
+    /// \brief The database of a shard, for the queries that ShardedDatabase doesn't provide itself.
+    ///
+    ThreadedDatabase &shard(std::size_t index);
+
+    ///
+    /// \brief Execute an SQL query on the shard of a key, ignoring the result.
+    /// \param key that decides the shard
+    /// \param SQL query string to execute
+    /// \param Parameters to bind to the placeholders in the SQL Query
+    ///
+    template <typename ...Args>
+    requires isQVariantConvertible<Args...>
+    auto execute(const QVariant &shardKey, const QString &sqlQuery, Args... args) -> QFuture<void> {
+        return shard(shardIndex(shardKey)).execute(sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like ThreadedDatabase::getResult, on the shard of a key.
+    ///
+    template <typename T, typename ...Args>
+    requires FromSql<T> && isQVariantConvertible<Args...>
+    auto getResult(const QVariant &shardKey, const QString &sqlQuery, Args... args) -> QFuture<std::optional<T>> {
+        return shard(shardIndex(shardKey)).template getResult<T>(sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Run a query on all shards, and concatenate the results in the order of the shards.
+    ///
+    template <typename T, typename ...Args>
+    requires FromSql<T> && isQVariantConvertible<Args...>
+    auto getResults(const QString &sqlQuery, Args... args) -> QFuture<std::vector<T>> {
+        return getResults<T>(MergeOptions<T> {}, sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Run a query on all shards, and merge the results as described by the options.
+    ///
+    /// The results are merged on the thread of the shard that finished last.
+    /// If the queue of a shard is full, see DatabaseConfiguration::setMaxQueuedJobs, the future is canceled.
+    ///
+    template <typename T, typename ...Args>
+    requires FromSql<T> && isQVariantConvertible<Args...>
+    auto getResults(MergeOptions<T> options, const QString &sqlQuery, Args... args) -> QFuture<std::vector<T>> {
+        auto results = std::make_shared<asyncdatabase_private::ShardedResults<T>>();
+        results->shards.resize(shardCount());
+        results->remaining = shardCount();
+        results->options = std::move(options);
+        results->interface.reportStarted();
+
+        for (std::size_t i = 0; i < shardCount(); i++) {
+            auto &db = shard(i).readDb();
+            db.runWithCallback(nullptr, db.template resultsJob<T>(sqlQuery, args...), [results, i](std::vector<T> rows) {
+                results->finishShard(i, std::move(rows));
+            }, [results] {
+                results->rejectShard();
+            });
+        }
+        return results->interface.future();
+    }
+
+    ///
+    /// \brief Run the migrations in the directory on all shards, see ThreadedDatabase::runMigrations.
+    /// \return a future that finishes when all shards are migrated, or is canceled if the queue of a shard was full
+    ///
+    auto runMigrations(const QString &migrationDirectory) -> QFuture<void>;
+
+    ShardedDatabase();
+    ~ShardedDatabase();
+
+private:
+    std::unique_ptr<ShardedDatabasePrivate> d;
+};
@@ -4,15 +4,38 @@
 
 #include "threadeddatabase.h"
 
+#include <QDataStream>
 #include <QDir>
+#include <QFile>
 #include <QSqlDatabase>
 #include <QSqlQuery>
 #include <QUrl>
 #include <QStringBuilder>
 #include <QVariant>
+#include <QSqlDriver>
+#include <QSqlRecord>
 #include <QSqlResult>
 #include <QSqlError>
+#include <QTextStream>
 #include <QLoggingCategory>
+#include <QTimer>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef FUTURESQL_HAVE_SQLITE
+#include <sqlite3.h>
+#endif
 
 #define SCHAMA_MIGRATIONS_TABLE "__qt_schema_migrations"
 
@@ -105,236 +128,2908 @@ void runDatabaseMigrations(QSqlDatabase &database, const QString &migrationDirec
     qCDebug(asyncdatabase) << "Migrations finished";
 }
 
-struct AsyncSqlDatabasePrivate {
-    QSqlDatabase database;
-    std::unordered_map<QString, QSqlQuery> preparedQueryCache;
+struct CachedQuery {
+    QString sqlQuery;
+    QSqlQuery query;
+    // Set for queries known at compile time, which are looked up by their id instead of their text
+    std::optional<std::size_t> id;
 };
 
-// Internal asynchronous database class
-QFuture<void> AsyncSqlDatabase::establishConnection(const DatabaseConfiguration &configuration)
-{
-    return runAsync([=, this] {
-        d->database = QSqlDatabase::addDatabase(configuration.type());
-        if (configuration.databaseName()) {
-            d->database.setDatabaseName(*configuration.databaseName());
+struct Job {
+    std::shared_ptr<QFutureInterfaceBase> future;
+    std::function<void ()> run;
+    std::chrono::steady_clock::time_point queuedAt;
+    // Called instead of run if the job is dropped from a full queue
+    std::function<void ()> rejected;
+};
+
+// How long a job of each priority may wait before it is preferred over jobs of higher priority that were queued later
+constexpr std::array<std::chrono::milliseconds, 3> priorityAging = {
+    std::chrono::milliseconds(0),
+    std::chrono::milliseconds(100),
+    std::chrono::milliseconds(1000),
+};
+
+struct LaneCounters {
+    std::atomic<quint64> jobs = 0;
+    std::atomic<qint64> totalWait = 0;
+    std::atomic<qint64> maxWait = 0;
+};
+
+// Results of getCachedResults, shared by all connections of a database
+class ResultCache {
+public:
+    explicit ResultCache(std::size_t capacity)
+        : m_capacity(capacity)
+    {
+    }
+
+    std::shared_ptr<const void> find(const QByteArray &key)
+    {
+        std::lock_guard lock(m_mutex);
+        const auto it = m_index.find(key);
+        if (it == m_index.end()) {
+            m_misses++;
+            return {};
         }
-        if (configuration.hostName()) {
-            d->database.setHostName(*configuration.hostName());
+
+        m_hits++;
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return it->second->result;
+    }
+
+    // Changes whenever results are invalidated
+    quint64 generation() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_generation;
+    }
+
+    bool accepts(quint64 generation, std::size_t rows) const
+    {
+        std::lock_guard lock(m_mutex);
+        return generation == m_generation && weight(rows) <= m_capacity;
+    }
+
+    void insert(const QByteArray &key, quint64 generation, std::vector<std::string> tables, std::size_t rows, std::shared_ptr<const void> result)
+    {
+        std::lock_guard lock(m_mutex);
+        if (generation != m_generation || weight(rows) > m_capacity) {
+            return;
         }
-        if (configuration.userName()) {
-            d->database.setUserName(*configuration.userName());
+
+        if (const auto existing = m_index.find(key); existing != m_index.end()) {
+            erase(existing->second);
         }
-        if (configuration.password()) {
-            d->database.setPassword(*configuration.password());
+        m_entries.push_front(Entry { key, std::move(tables), weight(rows), std::move(result) });
+        m_index[key] = m_entries.begin();
+        m_size += weight(rows);
+
+        while (m_size > m_capacity) {
+            erase(std::prev(m_entries.end()));
+            m_evictions++;
         }
+    }
 
-        if (!d->database.open()) {
-            qCDebug(asyncdatabase) << "Failed to open database" << d->database.lastError().text();
-            if (configuration.databaseName()) {
-                qCDebug(asyncdatabase) << "Tried to use database" << *configuration.databaseName();
+    void invalidate(const std::unordered_set<std::string> &tables)
+    {
+        if (tables.empty()) {
+            return;
+        }
+
+        std::lock_guard lock(m_mutex);
+        m_generation++;
+        for (auto it = m_entries.begin(); it != m_entries.end();) {
+            const bool outdated = std::any_of(it->tables.begin(), it->tables.end(), [&](const std::string &table) {
+                return tables.contains(table);
+            });
+            if (outdated) {
+                it = erase(it);
+                m_invalidations++;
+            } else {
+                ++it;
             }
         }
-    });
-}
+    }
 
-auto AsyncSqlDatabase::runMigrations(const QString &migrationDirectory) -> QFuture<void> {
-    return runAsync([=, this] {
-        runDatabaseMigrations(d->database, migrationDirectory);
-    });
-}
+    void clear()
+    {
+        std::lock_guard lock(m_mutex);
+        m_generation++;
+        m_entries.clear();
+        m_index.clear();
+        m_size = 0;
+    }
 
-auto AsyncSqlDatabase::setCurrentMigrationLevel(const QString &migrationName) -> QFuture<void> {
-    return runAsync([=, this] {
-        createInternalTable(d->database);
-        markMigrationRun(d->database, migrationName);
-    });
-}
+    ResultCacheStatistics statistics() const
+    {
+        std::lock_guard lock(m_mutex);
+        return ResultCacheStatistics {
+            .hits = m_hits,
+            .misses = m_misses,
+            .invalidations = m_invalidations,
+            .evictions = m_evictions,
+            .size = m_entries.size(),
+            .rows = m_size,
+        };
+    }
 
-AsyncSqlDatabase::AsyncSqlDatabase()
-    : QObject()
-    , d(std::make_unique<AsyncSqlDatabasePrivate>())
-{
-}
+private:
+    struct Entry {
+        QByteArray key;
+        // Tables the query reads from
+        std::vector<std::string> tables;
+        std::size_t rows;
+        std::shared_ptr<const void> result;
+    };
 
-AsyncSqlDatabase::~AsyncSqlDatabase() {
-    runAsync([db = d->database] {
-        QSqlDatabase::removeDatabase(db.databaseName());
-    });
+    // Empty results take space as well
+    static std::size_t weight(std::size_t rows)
+    {
+        return std::max<std::size_t>(rows, 1);
+    }
+
+    std::list<Entry>::iterator erase(std::list<Entry>::iterator entry)
+    {
+        m_size -= entry->rows;
+        m_index.erase(entry->key);
+        return m_entries.erase(entry);
+    }
+
+    mutable std::mutex m_mutex;
+    const std::size_t m_capacity;
+    std::size_t m_size = 0;
+    quint64 m_generation = 0;
+    // The most recently used result first
+    std::list<Entry> m_entries;
+    std::unordered_map<QByteArray, std::list<Entry>::iterator> m_index;
+    quint64 m_hits = 0;
+    quint64 m_misses = 0;
+    quint64 m_invalidations = 0;
+    quint64 m_evictions = 0;
+};
+
+// Objects on the threads of the contexts of callbacks, see AsyncSqlDatabase::callbackReceiver
+struct CallbackReceivers {
+    std::mutex mutex;
+    std::unordered_map<QThread *, std::shared_ptr<QObject>> receivers;
 };
 
-Row AsyncSqlDatabase::retrieveRow(const QSqlQuery &query) {
-    Row row;
-    int i = 0;
+struct AsyncSqlDatabasePrivate {
+    QSqlDatabase database;
 
-    while (true) {
-        if (query.isValid()) {
-            QVariant value = query.value(i);
-            if (value.isValid()) {
-                row.push_back(std::move(value));
+    // Queued jobs, one queue per priority
+    std::mutex queueMutex;
+    std::array<std::deque<Job>, 3> queues;
+    // Time spent in the queue, in microseconds
+    std::array<LaneCounters, 3> laneCounters;
+    // Future of the job that is currently running
+    QFutureInterfaceBase *currentJob = nullptr;
+
+#ifdef FUTURESQL_HAVE_SQLITE
+    sqlite3 *sqlite = nullptr;
+#endif
+
+    // Prepared queries, the most recently used one first
+    std::list<CachedQuery> preparedQueries;
+    std::unordered_map<QString, std::list<CachedQuery>::iterator> preparedQueryCache;
+    std::size_t preparedQueryCacheSize = 0;
+    std::atomic<quint64> preparedQueryCacheHits = 0;
+    std::atomic<quint64> preparedQueryCacheMisses = 0;
+    std::atomic<quint64> preparedQueryCacheEvictions = 0;
+    std::atomic<std::size_t> preparedQueryCacheCount = 0;
+
+    // Prepared queries known at compile time, indexed by their id. They share the list and its limit with the others.
+    std::vector<std::optional<std::list<CachedQuery>::iterator>> registeredQueryCache;
+
+    std::atomic_int pendingJobs = 0;
+
+    // Shared with the threads, so they can remove their receiver when they finish
+    std::shared_ptr<CallbackReceivers> callbackReceivers = std::make_shared<CallbackReceivers>();
+
+    // Bounded queue, pendingJobs only changes under the queue mutex if it is enabled
+    std::size_t maxQueuedJobs = 0;
+    QueueFullPolicy queueFullPolicy = QueueFullPolicy::Block;
+    std::condition_variable queueNotFull;
+    std::atomic<std::size_t> queueHighWaterMark = 0;
+    std::atomic<quint64> rejectedJobs = 0;
+    std::atomic<quint64> droppedJobs = 0;
+
+    // Group commit
+    bool groupCommit = false;
+    std::chrono::milliseconds groupCommitWindow {};
+    std::size_t groupCommitMaxStatements = 0;
+    QTimer *groupCommitTimer = nullptr;
+    // Closes the connection on its thread if that finishes first
+    QMetaObject::Connection threadFinished;
+    // Read by other threads to bypass the result cache
+    std::atomic_bool groupOpen = false;
+    // Called once the group was committed, or rolled back because the commit failed
+    std::vector<std::function<void (bool committed)>> groupedWrites;
+
+    // Query timings
+    bool collectStatistics = false;
+    std::function<void (const QueryTiming &)> queryObserver;
+    std::optional<std::chrono::milliseconds> slowQueryThreshold;
+    std::size_t slowQueryLogSize = 0;
+    std::chrono::steady_clock::duration jobQueueWait {};
+    std::optional<QueryTiming> currentQuery;
+    // Kept while the query is measured, to read its bound values if it turns out to be slow
+    std::optional<QSqlQuery> currentSqlQuery;
+    std::chrono::steady_clock::time_point queryStart;
+    mutable std::mutex statisticsMutex;
+    std::unordered_map<QString, QueryStatistics> statistics;
+    std::deque<SlowQuery> slowQueries;
+    // Normalized queries whose plan was already logged, cleared when it holds slowQueryLogSize entries
+    std::unordered_set<QString> explainedQueries;
+
+    // Result cache
+    std::shared_ptr<ResultCache> resultCache;
+    // Tables written to by the current transaction, and by the transaction that was just committed
+    std::unordered_set<std::string> changedTables;
+    std::unordered_set<std::string> committedTables;
+    // Set while finding out which tables a query reads from
+    std::unordered_set<std::string> *readTables = nullptr;
+    bool usesVolatileFunction = false;
+    int walAutoCheckpoint = 1000;
+    bool changeHooksInstalled = false;
+
+    // Live queries, registered from other threads
+    struct Watcher {
+        std::vector<std::string> tables;
+        std::function<void ()> changed;
+    };
+    std::mutex watchersMutex;
+    std::unordered_map<quint64, Watcher> watchers;
+    quint64 nextWatcherId = 0;
+    // Tables committed to since the watchers were last notified
+    std::unordered_set<std::string> notifyTables;
+};
+
+// Replaces string and number literals with placeholders, and collapses whitespace
+static QString normalizeSql(const QString &sqlQuery)
+{
+    QString normalized;
+    normalized.reserve(sqlQuery.size());
+    bool space = false;
+    for (qsizetype i = 0; i < sqlQuery.size(); i++) {
+        const QChar c = sqlQuery[i];
+        if (c.isSpace()) {
+            space = !normalized.isEmpty();
+            continue;
+        }
+        if (space) {
+            normalized.append(u' ');
+            space = false;
+        }
+
+        if (c == u'\'') {
+            // Two quotes inside of a string are an escaped quote
+            for (i++; i < sqlQuery.size(); i++) {
+                if (sqlQuery[i] == u'\'') {
+                    if (i + 1 < sqlQuery.size() && sqlQuery[i + 1] == u'\'') {
+                        i++;
+                        continue;
+                    }
+                    break;
+                }
+            }
+            normalized.append(u'?');
+        } else if (c.isDigit() && (normalized.isEmpty() || !(normalized.back().isLetterOrNumber() || normalized.back() == u'_'
+                       || normalized.back() == u'?' || normalized.back() == u':' || normalized.back() == u'@' || normalized.back() == u'$'))) {
+            while (i + 1 < sqlQuery.size() && (sqlQuery[i + 1].isLetterOrNumber() || sqlQuery[i + 1] == u'.')) {
                 i++;
-            } else {
-                break;
             }
+            normalized.append(u'?');
         } else {
-            break;
+            normalized.append(c);
         }
     }
-    return row;
+    return normalized;
 }
 
-Rows AsyncSqlDatabase::retrieveRows(QSqlQuery &query)
+// Runs EXPLAIN QUERY PLAN with the same values, and indents each step below its parent step
+static QString explainQueryPlan(const QSqlDatabase &database, const QString &sqlQuery, const QVariantList &boundValues)
 {
-    Rows rows;
-    while (query.next()) {
-        rows.push_back(retrieveRow(query));
+    QSqlQuery query(database);
+    if (!query.prepare(QStringLiteral("EXPLAIN QUERY PLAN ") + sqlQuery)) {
+        printSqlError(query);
+        return {};
+    }
+    for (int i = 0; i < boundValues.size(); i++) {
+        query.bindValue(i, boundValues[i]);
+    }
+    if (!query.exec()) {
+        printSqlError(query);
+        return {};
     }
 
-    return rows;
+    // Columns are id, parent, notused and detail
+    std::unordered_map<int, int> depths;
+    QStringList steps;
+    while (query.next()) {
+        const auto parent = depths.find(query.value(1).toInt());
+        const int depth = parent != depths.end() ? parent->second + 1 : 0;
+        depths[query.value(0).toInt()] = depth;
+        steps.append(QString(depth * 2, u' ') + query.value(3).toString());
+    }
+    return steps.join(u'\n');
 }
 
-std::optional<Row> AsyncSqlDatabase::retrieveOptionalRow(QSqlQuery &query)
+static void addTiming(QueryStatistics &statistics, const QueryTiming &timing)
 {
-    query.next();
-
-    if (query.isValid()) {
-        return retrieveRow(query);
-    } else {
-        return std::nullopt;
+    statistics.count++;
+    if (!timing.succeeded) {
+        statistics.failures++;
+    }
+    if (timing.preparedQueryCacheHit) {
+        statistics.preparedQueryCacheHits++;
     }
+    statistics.rows += timing.rows;
+
+    statistics.queueWait.add(timing.queueWait);
+    statistics.prepare.add(timing.prepare);
+    statistics.execution.add(timing.execution);
+    statistics.fetch.add(timing.fetch);
+    statistics.deserialization.add(timing.deserialization);
+    statistics.total.add(timing.total());
 }
 
-QSqlDatabase &AsyncSqlDatabase::db()
+static void mergeStatistics(QueryStatistics &statistics, const QueryStatistics &other)
 {
-    return d->database;
+    statistics.count += other.count;
+    statistics.failures += other.failures;
+    statistics.preparedQueryCacheHits += other.preparedQueryCacheHits;
+    statistics.rows += other.rows;
+
+    statistics.queueWait.merge(other.queueWait);
+    statistics.prepare.merge(other.prepare);
+    statistics.execution.merge(other.execution);
+    statistics.fetch.merge(other.fetch);
+    statistics.deserialization.merge(other.deserialization);
+    statistics.total.merge(other.total);
 }
 
-void printSqlError(const QSqlQuery &query)
+// Statements that can't be run inside of the transaction of a group commit
+static bool isGroupable(const QString &sqlQuery)
 {
-    qCDebug(asyncdatabase) << "SQL error:" << query.lastError().text();
+    const auto statement = QStringView(sqlQuery).trimmed();
+    for (const auto keyword : {"BEGIN", "COMMIT", "END", "ROLLBACK", "SAVEPOINT", "RELEASE", "PRAGMA", "VACUUM", "ATTACH", "DETACH"}) {
+        if (statement.startsWith(QLatin1String(keyword), Qt::CaseInsensitive)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-std::optional<QSqlQuery> AsyncSqlDatabase::prepareQuery(const QSqlDatabase &database, const QString &sqlQuery)
+#ifdef FUTURESQL_HAVE_SQLITE
+// Returns the SQLite handle of the connection, if the driver uses the same SQLite library as this library.
+// Using the handle with a different SQLite library would corrupt the connection.
+static sqlite3 *sqliteHandle(const QSqlDatabase &database)
 {
-    qCDebug(asyncdatabase) << "Running" << sqlQuery;
-
-    // Check whether we already have a prepared version of this query
-    if (d->preparedQueryCache.contains(sqlQuery)) {
-        return d->preparedQueryCache[sqlQuery];
+    const QVariant handle = database.driver()->handle();
+    if (!handle.isValid() || qstrcmp(handle.typeName(), "sqlite3*") != 0) {
+        return nullptr;
     }
 
-    // If not, prepare one
     QSqlQuery query(database);
-
-    // If this fails, return without caching the query
-    if (!query.prepare(sqlQuery)) {
-        printSqlError(query);
-        return {};
+    if (!query.exec(QStringLiteral("SELECT sqlite_source_id()")) || !query.next()
+            || query.value(0).toString() != QString::fromUtf8(sqlite3_sourceid())) {
+        qCDebug(asyncdatabase) << "The SQLite driver uses a different SQLite library, running queries can't be interrupted";
+        return nullptr;
     }
 
-    // Else, cache the prepared query
-    d->preparedQueryCache.insert({sqlQuery, query});
-    return query;
+    return *static_cast<sqlite3 *const *>(handle.constData());
 }
 
-QSqlQuery AsyncSqlDatabase::runQuery(QSqlQuery &query)
+// SQLite progress handler, aborts the running statement if its job was canceled
+static int interruptCanceledJob(void *data)
 {
-    if (!query.exec()) {
-        printSqlError(query);
-    }
-    return query;
+    const auto *job = static_cast<AsyncSqlDatabasePrivate *>(data)->currentJob;
+    return job && job->isCanceled() ? 1 : 0;
 }
+#endif
 
+#ifdef FUTURESQL_HAVE_SQLITE
+// Functions whose result differs between calls, so results of queries that use them can't be cached
+static bool isVolatileFunction(const char *name)
+{
+    static constexpr std::array functions = {
+        "random", "randomblob", "changes", "total_changes", "last_insert_rowid",
+        "date", "time", "datetime", "julianday", "unixepoch", "strftime", "timediff",
+        "current_date", "current_time", "current_timestamp",
+    };
+    return std::any_of(functions.begin(), functions.end(), [name](const char *function) {
+        return sqlite3_stricmp(name, function) == 0;
+    });
 }
 
-struct DatabaseConfigurationPrivate : public QSharedData {
-    QString type;
-    std::optional<QString> hostName;
-    std::optional<QString> databaseName;
-    std::optional<QString> userName;
-    std::optional<QString> password;
-};
-
-DatabaseConfiguration::DatabaseConfiguration() : d(new DatabaseConfigurationPrivate)
-{}
-
-DatabaseConfiguration::~DatabaseConfiguration() = default;
-DatabaseConfiguration::DatabaseConfiguration(const DatabaseConfiguration &) = default;
-
-void DatabaseConfiguration::setType(const QString &type) {
-    d->type = type;
+// SQLite authorizer of connections with a result cache, which never denies anything
+static int trackTablesForResultCache(void *data, int action, const char *first, const char *second, const char *, const char *)
+{
+    auto *d = static_cast<AsyncSqlDatabasePrivate *>(data);
+    switch (action) {
+    case SQLITE_READ:
+        if (d->readTables && first) {
+            d->readTables->emplace(first);
+        }
+        break;
+    case SQLITE_FUNCTION:
+        if (d->readTables && second && isVolatileFunction(second)) {
+            d->usesVolatileFunction = true;
+        }
+        break;
+    case SQLITE_DELETE:
+        // Otherwise deleting all rows of a table truncates it without calling the update hook
+        if (first && sqlite3_strnicmp(first, "sqlite_", 7) != 0) {
+            return SQLITE_IGNORE;
+        }
+        break;
+    case SQLITE_DROP_TABLE:
+    case SQLITE_DROP_TEMP_TABLE:
+        if (first) {
+            d->changedTables.emplace(first);
+        }
+        break;
+    case SQLITE_ALTER_TABLE:
+        if (second) {
+            d->changedTables.emplace(second);
+        }
+        break;
+    case SQLITE_PRAGMA:
+        // Setting it would reinstall the WAL hook of SQLite in place of ours, so take over the interval instead
+        if (first && second && sqlite3_stricmp(first, "wal_autocheckpoint") == 0) {
+            d->walAutoCheckpoint = QByteArray(second).toInt();
+            return SQLITE_IGNORE;
+        }
+        break;
+    }
+    return SQLITE_OK;
 }
 
-const QString &DatabaseConfiguration::type() const {
-    return d->type;
+static void recordChangedTable(void *data, int, const char *, const char *table, sqlite3_int64)
+{
+    static_cast<AsyncSqlDatabasePrivate *>(data)->changedTables.emplace(table);
 }
 
-void DatabaseConfiguration::setHostName(const QString &hostName) {
-    d->hostName = hostName;
+// Called before the commit, so the writer doesn't see outdated results once its query finished
+static int invalidateOnCommit(void *data)
+{
+    auto *d = static_cast<AsyncSqlDatabasePrivate *>(data);
+    d->committedTables = std::move(d->changedTables);
+    d->changedTables.clear();
+    d->notifyTables.insert(d->committedTables.begin(), d->committedTables.end());
+    if (d->resultCache) {
+        d->resultCache->invalidate(d->committedTables);
+    }
+    return 0;
 }
 
-const std::optional<QString> &DatabaseConfiguration::hostName() const {
-    return d->hostName;
+static void forgetChangedTables(void *data)
+{
+    static_cast<AsyncSqlDatabasePrivate *>(data)->changedTables.clear();
 }
 
-void DatabaseConfiguration::setDatabaseName(const QString &databaseName) {
-    d->databaseName = databaseName;
+// Called after the commit in WAL mode. Other connections may have cached results between the commit hook
+// and the commit becoming visible to them, which are outdated as well.
+static int invalidateAfterCommit(void *data, sqlite3 *database, const char *schema, int pages)
+{
+    auto *d = static_cast<AsyncSqlDatabasePrivate *>(data);
+    if (d->resultCache) {
+        d->resultCache->invalidate(d->committedTables);
+    }
+    d->committedTables.clear();
+
+    // Replaces the hook of SQLite that checkpoints the WAL automatically
+    if (d->walAutoCheckpoint > 0 && pages >= d->walAutoCheckpoint) {
+        sqlite3_wal_checkpoint(database, schema);
+    }
+    return SQLITE_OK;
 }
+#endif
 
-const std::optional<QString> &DatabaseConfiguration::databaseName() const {
-    return d->databaseName;
+static bool runPragma(const QSqlDatabase &database, const QString &pragma, const QString &value)
+{
+    QSqlQuery query(database);
+    if (!query.exec(QStringLiteral("PRAGMA %1 = %2").arg(pragma, value))) {
+        printSqlError(query);
+        return false;
+    }
+    return true;
 }
 
-void DatabaseConfiguration::setUserName(const QString &userName) {
-    d->userName = userName;
+static QString journalModeName(SqliteJournalMode mode)
+{
+    switch (mode) {
+    case SqliteJournalMode::Delete:
+        return QStringLiteral("DELETE");
+    case SqliteJournalMode::Truncate:
+        return QStringLiteral("TRUNCATE");
+    case SqliteJournalMode::Persist:
+        return QStringLiteral("PERSIST");
+    case SqliteJournalMode::Memory:
+        return QStringLiteral("MEMORY");
+    case SqliteJournalMode::Wal:
+        return QStringLiteral("WAL");
+    case SqliteJournalMode::Off:
+        return QStringLiteral("OFF");
+    }
+    Q_UNREACHABLE();
 }
 
-const std::optional<QString> &DatabaseConfiguration::userName() const {
-    return d->userName;
+static QString synchronousName(SqliteSynchronous synchronous)
+{
+    switch (synchronous) {
+    case SqliteSynchronous::Off:
+        return QStringLiteral("OFF");
+    case SqliteSynchronous::Normal:
+        return QStringLiteral("NORMAL");
+    case SqliteSynchronous::Full:
+        return QStringLiteral("FULL");
+    case SqliteSynchronous::Extra:
+        return QStringLiteral("EXTRA");
+    }
+    Q_UNREACHABLE();
 }
 
-void DatabaseConfiguration::setPassword(const QString &password) {
-    d->password = password;
+static QString tempStoreName(SqliteTempStore tempStore)
+{
+    switch (tempStore) {
+    case SqliteTempStore::Default:
+        return QStringLiteral("DEFAULT");
+    case SqliteTempStore::File:
+        return QStringLiteral("FILE");
+    case SqliteTempStore::Memory:
+        return QStringLiteral("MEMORY");
+    }
+    Q_UNREACHABLE();
 }
 
-const std::optional<QString> &DatabaseConfiguration::password() const {
-    return d->password;
+static void applySqliteSettings(const QSqlDatabase &database, const DatabaseConfiguration &configuration, bool readOnly)
+{
+    // Set first, so the other settings can wait for locks
+    if (configuration.busyTimeout()) {
+        runPragma(database, QStringLiteral("busy_timeout"), QString::number(configuration.busyTimeout()->count()));
+    }
+
+    if (configuration.journalMode() && !readOnly) {
+        // Returns the journal mode that is used now, which can differ, for example for in-memory databases
+        QSqlQuery query(database);
+        const auto mode = journalModeName(*configuration.journalMode());
+        if (!query.exec(QStringLiteral("PRAGMA journal_mode = %1").arg(mode))) {
+            printSqlError(query);
+        } else if (query.next() && query.value(0).toString().compare(mode, Qt::CaseInsensitive) != 0) {
+            qCDebug(asyncdatabase) << "Could not change the journal mode to" << mode << "it is" << query.value(0).toString();
+        }
+    }
+    if (configuration.synchronous()) {
+        runPragma(database, QStringLiteral("synchronous"), synchronousName(*configuration.synchronous()));
+    }
+    if (configuration.cacheSize()) {
+        runPragma(database, QStringLiteral("cache_size"), QString::number(*configuration.cacheSize()));
+    }
+    if (configuration.mmapSize()) {
+        runPragma(database, QStringLiteral("mmap_size"), QString::number(*configuration.mmapSize()));
+    }
+    if (configuration.tempStore()) {
+        runPragma(database, QStringLiteral("temp_store"), tempStoreName(*configuration.tempStore()));
+    }
 }
 
+// Internal asynchronous database class
+QFuture<void> AsyncSqlDatabase::establishConnection(const DatabaseConfiguration &configuration, bool readOnly)
+{
+    // Needs to be known before the first query is submitted
+    d->maxQueuedJobs = configuration.maxQueuedJobs();
+    d->queueFullPolicy = configuration.queueFullPolicy();
+    if (!readOnly && configuration.groupCommitWindow()) {
+        d->groupCommit = true;
+        d->groupCommitWindow = *configuration.groupCommitWindow();
+        d->groupCommitMaxStatements = configuration.groupCommitMaxStatements();
+    }
 
-struct ThreadedDatabasePrivate {
-    asyncdatabase_private::AsyncSqlDatabase db;
-};
+    // Must run before any other query
+    QueryPriorityScope priority(QueryPriority::Interactive);
+    return runAsync([=, this] {
+        d->preparedQueryCacheSize = configuration.preparedQueryCacheSize();
+        d->collectStatistics = configuration.collectStatistics();
+        d->queryObserver = configuration.queryObserver();
+        d->slowQueryThreshold = configuration.slowQueryThreshold();
+        d->slowQueryLogSize = configuration.slowQueryLogSize();
+        if (d->groupCommit) {
+            d->groupCommitTimer = new QTimer(this);
+            d->groupCommitTimer->setSingleShot(true);
+            connect(d->groupCommitTimer, &QTimer::timeout, this, &AsyncSqlDatabase::commitGroup);
+        }
 
-std::unique_ptr<ThreadedDatabase> ThreadedDatabase::establishConnection(const DatabaseConfiguration &config) {
-    auto threadedDb = std::make_unique<ThreadedDatabase>();
-    threadedDb->setObjectName(QStringLiteral("database thread"));
-    threadedDb->d->db.moveToThread(&*threadedDb);
-    threadedDb->start();
-    threadedDb->d->db.establishConnection(config);
-    return threadedDb;
-}
+        // QSqlDatabase::removeDatabase must run on the thread that added the database.
+        // If the thread finishes before close() was called, the connection is closed right before.
+        d->threadFinished = connect(thread(), &QThread::finished, this, [this] {
+            closeConnection();
+        }, Qt::DirectConnection);
 
-auto ThreadedDatabase::runMigrations(const QString &migrationDirectory) -> QFuture<void> {
-    return d->db.runMigrations(migrationDirectory);
-}
+        // Every connection needs its own name, so multiple connections to the same database can coexist
+        static std::atomic_int connectionCount = 0;
+        d->database = QSqlDatabase::addDatabase(configuration.type(), QStringLiteral("futuresql-%1").arg(connectionCount++));
+        if (configuration.databaseName()) {
+            d->database.setDatabaseName(*configuration.databaseName());
+        }
+        if (configuration.hostName()) {
+            d->database.setHostName(*configuration.hostName());
+        }
+        if (configuration.userName()) {
+            d->database.setUserName(*configuration.userName());
+        }
+        if (configuration.password()) {
+            d->database.setPassword(*configuration.password());
+        }
+        if (configuration.connectOptions()) {
+            d->database.setConnectOptions(*configuration.connectOptions());
+        }
 
-auto ThreadedDatabase::setCurrentMigrationLevel(const QString &migrationName) -> QFuture<void> {
-    return d->db.setCurrentMigrationLevel(migrationName);
-}
+        if (!d->database.open()) {
+            qCDebug(asyncdatabase) << "Failed to open database" << d->database.lastError().text();
+            if (configuration.databaseName()) {
+                qCDebug(asyncdatabase) << "Tried to use database" << *configuration.databaseName();
+            }
+            return;
+        }
 
-ThreadedDatabase::ThreadedDatabase()
-    : QThread()
-    , d(std::make_unique<ThreadedDatabasePrivate>())
-{
-}
+        // Runs in the same job as opening the database, so no other query can run before
+        if (configuration.type() == DATABASE_TYPE_SQLITE) {
+            applySqliteSettings(d->database, configuration, readOnly);
+        }
+        for (const auto &statement : configuration.initStatements()) {
+            QSqlQuery query(d->database);
+            if (!query.exec(statement)) {
+                printSqlError(query);
+            }
+        }
 
-ThreadedDatabase::~ThreadedDatabase()
-{
-    quit();
-    wait();
-}
+        // Opening the file itself read-only would fail if the writing connection did not create it yet,
+        // so make sure no writes happen on this connection instead.
+        if (readOnly && configuration.type() == DATABASE_TYPE_SQLITE) {
+            QSqlQuery query(d->database);
+            if (!query.exec(QStringLiteral("PRAGMA query_only = ON"))) {
+                printSqlError(query);
+            }
+        }
+
+#ifdef FUTURESQL_HAVE_SQLITE
+        if (configuration.type() == DATABASE_TYPE_SQLITE) {
+            d->sqlite = sqliteHandle(d->database);
+            if (d->sqlite) {
+                sqlite3_progress_handler(d->sqlite, 1000, interruptCanceledJob, d.get());
+                if (d->resultCache) {
+                    installChangeHooks();
+                }
+            }
+        }
+#endif
+    });
+}
+
+void AsyncSqlDatabase::close()
+{
+    // Jobs that were submitted before still run first
+    if (thread()->isRunning() && QThread::currentThread() != thread()) {
+        // The thread may keep running for other connections of a DatabaseThreadPool,
+        // so hand this object over to the caller, which destroys it.
+        // Waiting from another pool thread could deadlock, ~ThreadedDatabase asserts that it doesn't.
+        QMetaObject::invokeMethod(this, [this, caller = QThread::currentThread()] {
+            closeConnection();
+            moveToThread(caller);
+        }, Qt::BlockingQueuedConnection);
+    } else {
+        // The thread either never opened the database, or closed it when it finished
+        closeConnection();
+    }
+
+    // Callbacks that are still posted keep their receiver alive
+    std::lock_guard lock(d->callbackReceivers->mutex);
+    d->callbackReceivers->receivers.clear();
+}
+
+void AsyncSqlDatabase::closeConnection()
+{
+    // Afterwards this object may move to another thread, where it must not be closed from the old thread
+    disconnect(d->threadFinished);
+    commitGroup();
+    delete d->groupCommitTimer;
+    d->groupCommitTimer = nullptr;
+    closeDatabase();
+}
+
+void AsyncSqlDatabase::closeDatabase()
+{
+#ifdef FUTURESQL_HAVE_SQLITE
+    if (d->sqlite) {
+        sqlite3_progress_handler(d->sqlite, 0, nullptr, nullptr);
+        if (d->changeHooksInstalled) {
+            d->changeHooksInstalled = false;
+            sqlite3_set_authorizer(d->sqlite, nullptr, nullptr);
+            sqlite3_update_hook(d->sqlite, nullptr, nullptr);
+            sqlite3_commit_hook(d->sqlite, nullptr, nullptr);
+            sqlite3_rollback_hook(d->sqlite, nullptr, nullptr);
+            sqlite3_wal_hook(d->sqlite, nullptr, nullptr);
+        }
+        d->sqlite = nullptr;
+    }
+#endif
+
+    const auto connectionName = d->database.connectionName();
+    d->preparedQueryCache.clear();
+    d->preparedQueries.clear();
+    d->registeredQueryCache.clear();
+    d->database = QSqlDatabase();
+    if (!connectionName.isEmpty()) {
+        QSqlDatabase::removeDatabase(connectionName);
+    }
+}
+
+bool AsyncSqlDatabase::groupCommitEnabled() const
+{
+    return d->groupCommit;
+}
+
+void AsyncSqlDatabase::runGroupedWrite(std::function<void (bool committed)> finished, const QString &sqlQuery, const std::function<bool ()> &write)
+{
+    if (!isGroupable(sqlQuery)) {
+        commitGroup();
+        write();
+        finished(true);
+        return;
+    }
+
+    if (!d->groupOpen) {
+        // If a transaction is already open, there is nothing to group the write into
+        if (!d->database.transaction()) {
+            write();
+            finished(true);
+            return;
+        }
+
+        d->groupOpen = true;
+        d->groupCommitTimer->start(d->groupCommitWindow);
+    }
+
+    // Isolate the statement, so if it fails it doesn't affect the other statements of the group
+    QSqlQuery savepoint(d->database);
+    if (!savepoint.exec(QStringLiteral("SAVEPOINT futuresql_group_commit"))) {
+        printSqlError(savepoint);
+    }
+
+    if (write()) {
+        savepoint.exec(QStringLiteral("RELEASE futuresql_group_commit"));
+    } else {
+        savepoint.exec(QStringLiteral("ROLLBACK TO futuresql_group_commit"));
+        savepoint.exec(QStringLiteral("RELEASE futuresql_group_commit"));
+    }
+
+    d->groupedWrites.push_back(std::move(finished));
+    if (d->groupedWrites.size() >= d->groupCommitMaxStatements) {
+        commitGroup();
+    }
+}
+
+void AsyncSqlDatabase::commitGroup()
+{
+    if (!d->groupOpen) {
+        return;
+    }
+
+    d->groupOpen = false;
+    d->groupCommitTimer->stop();
+
+    // The writes of the group must not be lost if the job that happens to commit them was canceled
+    auto *const job = std::exchange(d->currentJob, nullptr);
+
+    qCDebug(asyncdatabase) << "Committing" << d->groupedWrites.size() << "grouped writes";
+    const bool committed = d->database.commit();
+    if (!committed) {
+        qCWarning(asyncdatabase) << "Failed to commit" << d->groupedWrites.size() << "grouped writes:" << d->database.lastError().text();
+        d->database.rollback();
+    }
+
+    d->currentJob = job;
+
+    // A callback may submit a write, which starts the next group
+    const auto groupedWrites = std::exchange(d->groupedWrites, {});
+    for (const auto &finished : groupedWrites) {
+        finished(committed);
+    }
+    notifyWatchers();
+}
+
+void AsyncSqlDatabase::setResultCache(std::shared_ptr<ResultCache> cache)
+{
+    d->resultCache = std::move(cache);
+}
+
+bool AsyncSqlDatabase::hasResultCache() const
+{
+    return d->resultCache != nullptr;
+}
+
+QByteArray AsyncSqlDatabase::resultCacheKey(const QString &sqlQuery, const char *type, const QVariantList &args)
+{
+    QByteArray key;
+    QDataStream stream(&key, QIODevice::WriteOnly);
+    stream << sqlQuery << QByteArray(type) << args;
+    return key;
+}
+
+std::shared_ptr<const void> AsyncSqlDatabase::cachedResult(const QByteArray &key)
+{
+    return d->resultCache->find(key);
+}
+
+quint64 AsyncSqlDatabase::resultCacheGeneration() const
+{
+    return d->resultCache->generation();
+}
+
+void AsyncSqlDatabase::storeResult(const QByteArray &key, const QString &sqlQuery, quint64 generation, std::size_t rows, const std::function<std::shared_ptr<const void> ()> &copy)
+{
+#ifdef FUTURESQL_HAVE_SQLITE
+    // Without the hooks, writes would go unnoticed.
+    // Inside of a transaction, the result may contain writes that are rolled back later.
+    if (!d->sqlite || !sqlite3_get_autocommit(d->sqlite) || !d->resultCache->accepts(generation, rows)) {
+        return;
+    }
+
+    // A query that reads no table could still return something different each time
+    std::unordered_set<std::string> tables;
+    if (!findReadTables(sqlQuery, tables) || tables.empty() || d->usesVolatileFunction) {
+        return;
+    }
+
+    d->resultCache->insert(key, generation, std::vector<std::string>(tables.begin(), tables.end()), rows, copy());
+#else
+    Q_UNUSED(key)
+    Q_UNUSED(sqlQuery)
+    Q_UNUSED(generation)
+    Q_UNUSED(rows)
+    Q_UNUSED(copy)
+#endif
+}
+
+bool AsyncSqlDatabase::findReadTables(const QString &sqlQuery, std::unordered_set<std::string> &tables)
+{
+#ifdef FUTURESQL_HAVE_SQLITE
+    if (!d->changeHooksInstalled) {
+        return false;
+    }
+
+    // Preparing the query again lets the authorizer see which tables it reads from
+    d->readTables = &tables;
+    d->usesVolatileFunction = false;
+    const QByteArray sql = sqlQuery.toUtf8();
+    sqlite3_stmt *statement = nullptr;
+    const int result = sqlite3_prepare_v2(d->sqlite, sql.constData(), int(sql.size()), &statement, nullptr);
+    sqlite3_finalize(statement);
+    d->readTables = nullptr;
+    return result == SQLITE_OK;
+#else
+    Q_UNUSED(sqlQuery)
+    Q_UNUSED(tables)
+    return false;
+#endif
+}
+
+void AsyncSqlDatabase::installChangeHooks()
+{
+#ifdef FUTURESQL_HAVE_SQLITE
+    if (!d->sqlite || d->changeHooksInstalled) {
+        return;
+    }
+    d->changeHooksInstalled = true;
+
+    // The WAL hook replaces the automatic checkpoints, which need to keep their configured interval
+    QSqlQuery query(d->database);
+    if (query.exec(QStringLiteral("PRAGMA wal_autocheckpoint")) && query.next()) {
+        d->walAutoCheckpoint = query.value(0).toInt();
+    }
+
+    sqlite3_set_authorizer(d->sqlite, trackTablesForResultCache, d.get());
+    sqlite3_update_hook(d->sqlite, recordChangedTable, d.get());
+    sqlite3_commit_hook(d->sqlite, invalidateOnCommit, d.get());
+    sqlite3_rollback_hook(d->sqlite, forgetChangedTables, d.get());
+    sqlite3_wal_hook(d->sqlite, invalidateAfterCommit, d.get());
+#endif
+}
+
+quint64 AsyncSqlDatabase::watchTables(const QString &sqlQuery, std::function<void ()> changed)
+{
+    quint64 id = 0;
+    {
+        std::lock_guard lock(d->watchersMutex);
+        id = d->nextWatcherId++;
+        d->watchers.emplace(id, AsyncSqlDatabasePrivate::Watcher { {}, std::move(changed) });
+    }
+
+    // Writes that are committed after this job are noticed
+    runAsync([this, id, sqlQuery] {
+        installChangeHooks();
+        std::unordered_set<std::string> tables;
+        if (!findReadTables(sqlQuery, tables)) {
+            qCDebug(asyncdatabase) << "Changes of the tables of" << sqlQuery << "can't be watched";
+        }
+
+        std::lock_guard lock(d->watchersMutex);
+        if (const auto watcher = d->watchers.find(id); watcher != d->watchers.end()) {
+            watcher->second.tables.assign(tables.begin(), tables.end());
+            watcher->second.changed();
+        }
+    });
+    return id;
+}
+
+void AsyncSqlDatabase::unwatchTables(quint64 id)
+{
+    std::lock_guard lock(d->watchersMutex);
+    d->watchers.erase(id);
+}
+
+void AsyncSqlDatabase::notifyWatchers()
+{
+    if (d->notifyTables.empty()) {
+        return;
+    }
+
+    const auto tables = std::exchange(d->notifyTables, {});
+    std::lock_guard lock(d->watchersMutex);
+    for (const auto &[id, watcher] : d->watchers) {
+        const bool changed = std::any_of(watcher.tables.begin(), watcher.tables.end(), [&](const std::string &table) {
+            return tables.contains(table);
+        });
+        if (changed) {
+            watcher.changed();
+        }
+    }
+}
+
+int AsyncSqlDatabase::pendingJobs() const
+{
+    return d->pendingJobs;
+}
+
+bool AsyncSqlDatabase::hasPendingWrites() const
+{
+    return d->pendingJobs > 0 || d->groupOpen;
+}
+
+PreparedQueryCacheStatistics AsyncSqlDatabase::preparedQueryCacheStatistics() const
+{
+    return PreparedQueryCacheStatistics {
+        .hits = d->preparedQueryCacheHits,
+        .misses = d->preparedQueryCacheMisses,
+        .evictions = d->preparedQueryCacheEvictions,
+        .size = d->preparedQueryCacheCount,
+    };
+}
+
+QFuture<void> AsyncSqlDatabase::clearPreparedQueryCache()
+{
+    // Interactive jobs have no grace period, so no job that is submitted later can run first
+    QueryPriorityScope priority(QueryPriority::Interactive);
+    return runAsync([this] {
+        d->preparedQueryCache.clear();
+        d->preparedQueries.clear();
+        d->preparedQueryCacheCount = 0;
+        d->registeredQueryCache.clear();
+    });
+}
+
+QueueStatistics AsyncSqlDatabase::queueStatistics() const
+{
+    QueueStatistics statistics;
+    for (size_t i = 0; i < d->laneCounters.size(); i++) {
+        statistics.lanes[i] = QueueStatistics::Lane {
+            .jobs = d->laneCounters[i].jobs,
+            .totalWait = std::chrono::microseconds(d->laneCounters[i].totalWait),
+            .maxWait = std::chrono::microseconds(d->laneCounters[i].maxWait),
+        };
+    }
+    statistics.depth = std::size_t(std::max(int(d->pendingJobs), 0));
+    statistics.highWaterMark = d->queueHighWaterMark;
+    statistics.rejected = d->rejectedJobs;
+    statistics.dropped = d->droppedJobs;
+    return statistics;
+}
+
+void AsyncSqlDatabase::enqueue(std::shared_ptr<QFutureInterfaceBase> future, std::function<void ()> job, std::function<void ()> rejected)
+{
+    const auto priority = size_t(currentQueryPriority());
+    std::optional<Job> dropped;
+    bool accepted = true;
+    {
+        std::unique_lock lock(d->queueMutex);
+        if (d->maxQueuedJobs > 0 && std::size_t(d->pendingJobs) >= d->maxQueuedJobs) {
+            switch (d->queueFullPolicy) {
+            case QueueFullPolicy::Fail:
+                accepted = false;
+                break;
+            case QueueFullPolicy::Block:
+                // The database thread would wait for itself
+                if (QThread::currentThread() != thread()) {
+                    d->queueNotFull.wait(lock, [this] {
+                        return std::size_t(d->pendingJobs) < d->maxQueuedJobs;
+                    });
+                }
+                break;
+            case QueueFullPolicy::DropOldestBackground:
+                if (auto &background = d->queues[size_t(QueryPriority::Background)]; !background.empty()) {
+                    dropped = std::move(background.front());
+                    background.pop_front();
+                    d->pendingJobs--;
+                } else {
+                    accepted = false;
+                }
+                break;
+            }
+        }
+
+        if (accepted) {
+            d->queues[priority].push_back(Job { std::move(future), std::move(job), std::chrono::steady_clock::now(), std::move(rejected) });
+            const auto depth = std::size_t(++d->pendingJobs);
+            if (depth > d->queueHighWaterMark) {
+                d->queueHighWaterMark = depth;
+            }
+        }
+    }
+
+    if (dropped) {
+        d->droppedJobs++;
+        rejectJob(dropped->future, dropped->rejected);
+    }
+    if (!accepted) {
+        qCDebug(asyncdatabase) << "Rejecting a query, because" << d->maxQueuedJobs << "queries are already queued";
+        d->rejectedJobs++;
+        rejectJob(future, rejected);
+        return;
+    }
+
+    // Each event runs one job, but not necessarily the one it was posted for.
+    // Always queued, so a job submitted from the database thread doesn't run inside of the job that is running.
+    QMetaObject::invokeMethod(this, [this] {
+        runNextJob();
+    }, Qt::QueuedConnection);
+}
+
+std::shared_ptr<QObject> AsyncSqlDatabase::callbackReceiver(QObject *context)
+{
+    if (!context) {
+        return nullptr;
+    }
+
+    QThread *thread = context->thread();
+    std::lock_guard lock(d->callbackReceivers->mutex);
+    auto &receiver = d->callbackReceivers->receivers[thread];
+    if (receiver) {
+        return receiver;
+    }
+
+    // Posted events keep the receiver alive, and deleting it later doesn't interfere with an event it is handling
+    receiver = std::shared_ptr<QObject>(new QObject, [](QObject *object) {
+        object->deleteLater();
+    });
+    receiver->moveToThread(thread);
+
+    // Deleted with the thread, otherwise a new thread at the same address would get a receiver on the finished thread
+    QObject::connect(thread, &QThread::finished, receiver.get(), [receivers = std::weak_ptr(d->callbackReceivers), thread] {
+        if (const auto shared = receivers.lock()) {
+            std::lock_guard lock(shared->mutex);
+            shared->receivers.erase(thread);
+        }
+    });
+    return receiver;
+}
+
+void AsyncSqlDatabase::rejectJob(const std::shared_ptr<QFutureInterfaceBase> &future, const std::function<void ()> &rejected)
+{
+    if (future) {
+        future->reportCanceled();
+        future->reportFinished();
+    }
+    if (rejected) {
+        rejected();
+    }
+}
+
+bool AsyncSqlDatabase::canRejectJobs() const
+{
+    // Blocking waits for space instead
+    return d->maxQueuedJobs > 0 && d->queueFullPolicy != QueueFullPolicy::Block;
+}
+
+void AsyncSqlDatabase::finishJob()
+{
+    if (d->maxQueuedJobs == 0) {
+        d->pendingJobs--;
+        return;
+    }
+
+    // Under the mutex, so a submitter that is about to wait doesn't miss the notification
+    {
+        std::lock_guard lock(d->queueMutex);
+        d->pendingJobs--;
+    }
+    d->queueNotFull.notify_one();
+}
+
+void AsyncSqlDatabase::runNextJob()
+{
+    Job job;
+    size_t priority = 0;
+    {
+        std::lock_guard lock(d->queueMutex);
+
+        // Pick the job with the earliest deadline, so jobs of lower priority don't starve
+        std::optional<std::chrono::steady_clock::time_point> earliestDeadline;
+        for (size_t i = 0; i < d->queues.size(); i++) {
+            if (d->queues[i].empty()) {
+                continue;
+            }
+
+            const auto deadline = d->queues[i].front().queuedAt + priorityAging[i];
+            if (!earliestDeadline || deadline < *earliestDeadline) {
+                earliestDeadline = deadline;
+                priority = i;
+            }
+        }
+
+        if (!earliestDeadline) {
+            return;
+        }
+
+        job = std::move(d->queues[priority].front());
+        d->queues[priority].pop_front();
+    }
+
+    const auto waited = std::chrono::steady_clock::now() - job.queuedAt;
+    const auto wait = std::chrono::duration_cast<std::chrono::microseconds>(waited).count();
+    auto &counters = d->laneCounters[priority];
+    counters.jobs++;
+    counters.totalWait += wait;
+    if (wait > counters.maxWait) {
+        counters.maxWait = wait;
+    }
+
+    // Nobody is interested in the result anymore
+    if (job.future && job.future->isCanceled()) {
+        job.future->reportFinished();
+        finishJob();
+        return;
+    }
+
+    d->currentJob = job.future.get();
+    d->jobQueueWait = waited;
+    job.run();
+    finishQueryTiming();
+    // Once the job committed its writes, their results are visible on all connections
+    notifyWatchers();
+    d->currentJob = nullptr;
+    finishJob();
+}
+
+bool AsyncSqlDatabase::isCurrentJobCanceled() const
+{
+    return d->currentJob && d->currentJob->isCanceled();
+}
+
+void AsyncSqlDatabase::startQueryTiming(const QString &sqlQuery)
+{
+    if (!d->collectStatistics && !d->queryObserver && !d->slowQueryThreshold) {
+        return;
+    }
+
+    finishQueryTiming();
+    d->currentQuery = QueryTiming {
+        .sql = sqlQuery,
+        .queueWait = std::exchange(d->jobQueueWait, {}),
+    };
+    d->queryStart = std::chrono::steady_clock::now();
+}
+
+void AsyncSqlDatabase::recordExecution(const QSqlQuery &query, std::chrono::steady_clock::time_point start, bool succeeded)
+{
+    if (!d->currentQuery) {
+        return;
+    }
+
+    d->currentQuery->prepare = start - d->queryStart;
+    d->currentQuery->execution = std::chrono::steady_clock::now() - start;
+    d->currentQuery->succeeded = succeeded;
+    if (d->slowQueryThreshold) {
+        d->currentSqlQuery = query;
+    }
+}
+
+void AsyncSqlDatabase::recordFetch(std::chrono::steady_clock::duration fetch, std::chrono::steady_clock::duration deserialization, quint64 rows)
+{
+    if (!d->currentQuery) {
+        return;
+    }
+
+    d->currentQuery->fetch += fetch;
+    d->currentQuery->deserialization += deserialization;
+    d->currentQuery->rows += rows;
+}
+
+void AsyncSqlDatabase::finishQueryTiming()
+{
+    if (!d->currentQuery) {
+        return;
+    }
+
+    const auto timing = std::move(*d->currentQuery);
+    d->currentQuery.reset();
+
+    if (d->collectStatistics) {
+        auto sql = normalizeSql(timing.sql);
+        std::lock_guard lock(d->statisticsMutex);
+        auto [entry, inserted] = d->statistics.try_emplace(sql);
+        if (inserted) {
+            entry->second.sql = std::move(sql);
+        }
+        addTiming(entry->second, timing);
+    }
+
+    if (d->queryObserver) {
+        d->queryObserver(timing);
+    }
+
+    if (d->slowQueryThreshold && timing.succeeded
+            && timing.execution + timing.fetch + timing.deserialization > *d->slowQueryThreshold) {
+        logSlowQuery(timing);
+    }
+    d->currentSqlQuery.reset();
+}
+
+void AsyncSqlDatabase::logSlowQuery(const QueryTiming &timing)
+{
+    SlowQuery slowQuery {
+        .sql = timing.sql,
+        .rows = timing.rows,
+        .duration = timing.execution + timing.fetch + timing.deserialization,
+        .time = std::chrono::system_clock::now(),
+    };
+
+    QVariantList boundValues;
+    if (d->currentSqlQuery) {
+        // On Qt 5, boundValues() is a map ordered by placeholder name, so the values are read by position
+        const int count = int(d->currentSqlQuery->boundValues().size());
+        for (int i = 0; i < count; i++) {
+            const QVariant value = d->currentSqlQuery->boundValue(i);
+            slowQuery.parameterTypes.append(QString::fromLatin1(value.typeName()));
+            boundValues.append(value);
+        }
+    }
+
+    // The plan usually doesn't change, so it is only logged the first time.
+    // Queries built at runtime can be unique, so the set is bounded like the slow query log.
+    if (d->database.driverName() == DATABASE_TYPE_SQLITE) {
+        QString normalized = normalizeSql(timing.sql);
+        if (!d->explainedQueries.contains(normalized)) {
+            if (d->explainedQueries.size() >= std::max<std::size_t>(d->slowQueryLogSize, 1)) {
+                d->explainedQueries.clear();
+            }
+            d->explainedQueries.insert(std::move(normalized));
+            slowQuery.queryPlan = explainQueryPlan(d->database, timing.sql, boundValues);
+        }
+    }
+
+    qCWarning(asyncdatabase).nospace() << "Slow query (" << std::chrono::duration<double, std::milli>(slowQuery.duration).count()
+                                       << " ms, " << slowQuery.rows << " rows): " << slowQuery.sql
+                                       << ", parameter types: " << slowQuery.parameterTypes;
+    if (!slowQuery.queryPlan.isEmpty()) {
+        qCWarning(asyncdatabase).noquote().nospace() << "Query plan:\n" << slowQuery.queryPlan;
+    }
+
+    std::lock_guard lock(d->statisticsMutex);
+    d->slowQueries.push_back(std::move(slowQuery));
+    while (d->slowQueries.size() > d->slowQueryLogSize) {
+        d->slowQueries.pop_front();
+    }
+}
+
+bool AsyncSqlDatabase::measuringQuery() const
+{
+    return d->currentQuery.has_value();
+}
+
+std::vector<SlowQuery> AsyncSqlDatabase::slowQueries() const
+{
+    std::lock_guard lock(d->statisticsMutex);
+    return std::vector<SlowQuery>(d->slowQueries.begin(), d->slowQueries.end());
+}
+
+std::vector<QueryStatistics> AsyncSqlDatabase::statistics() const
+{
+    std::lock_guard lock(d->statisticsMutex);
+    std::vector<QueryStatistics> statistics;
+    statistics.reserve(d->statistics.size());
+    for (const auto &[sql, queryStatistics] : d->statistics) {
+        statistics.push_back(queryStatistics);
+    }
+    return statistics;
+}
+
+auto AsyncSqlDatabase::runMigrations(const QString &migrationDirectory) -> QFuture<void> {
+    return runAsync([=, this] {
+        commitGroup();
+        runDatabaseMigrations(d->database, migrationDirectory);
+    });
+}
+
+void AsyncSqlDatabase::runMigrations(QObject *context, std::function<void ()> callback, const QString &migrationDirectory, std::function<void ()> rejected) {
+    runWithCallback(context, [=, this] {
+        commitGroup();
+        runDatabaseMigrations(d->database, migrationDirectory);
+    }, std::move(callback), std::move(rejected));
+}
+
+auto AsyncSqlDatabase::setCurrentMigrationLevel(const QString &migrationName) -> QFuture<void> {
+    return runAsync([=, this] {
+        commitGroup();
+        createInternalTable(d->database);
+        markMigrationRun(d->database, migrationName);
+    });
+}
+
+AsyncSqlDatabase::AsyncSqlDatabase()
+    : QObject()
+    , d(std::make_unique<AsyncSqlDatabasePrivate>())
+{
+}
+
+AsyncSqlDatabase::~AsyncSqlDatabase() {
+    // Usually close() was already called, or the thread closed the connection when it finished.
+    // Otherwise the database was never opened, and there is nothing left to remove.
+    closeDatabase();
+};
+
+QSqlDatabase &AsyncSqlDatabase::db()
+{
+    return d->database;
+}
+
+static thread_local QueryPriority queryPriority = QueryPriority::Normal;
+
+QueryPriority currentQueryPriority()
+{
+    return queryPriority;
+}
+
+QueryPriorityScope::QueryPriorityScope(QueryPriority priority)
+    : m_previous(queryPriority)
+{
+    queryPriority = priority;
+}
+
+QueryPriorityScope::~QueryPriorityScope()
+{
+    queryPriority = m_previous;
+}
+
+std::size_t registerQuery()
+{
+    static std::atomic<std::size_t> queryCount = 0;
+    return queryCount++;
+}
+
+void printSqlError(const QSqlQuery &query)
+{
+    qCDebug(asyncdatabase) << "SQL error:" << query.lastError().text();
+}
+
+// Drops the least recently used prepared query if there are too many
+static void evictPreparedQuery(AsyncSqlDatabasePrivate &d)
+{
+    if (d.preparedQueries.size() > d.preparedQueryCacheSize) {
+        const auto &last = d.preparedQueries.back();
+        if (last.id) {
+            d.registeredQueryCache[*last.id].reset();
+        } else {
+            d.preparedQueryCache.erase(last.sqlQuery);
+        }
+        d.preparedQueries.pop_back();
+        d.preparedQueryCacheEvictions++;
+    }
+    d.preparedQueryCacheCount = d.preparedQueries.size();
+}
+
+std::optional<QSqlQuery> AsyncSqlDatabase::prepareQuery(const QSqlDatabase &database, const QString &sqlQuery)
+{
+    qCDebug(asyncdatabase) << "Running" << sqlQuery;
+    startQueryTiming(sqlQuery);
+
+    // Check whether we already have a prepared version of this query
+    if (d->preparedQueryCacheSize > 0) {
+        auto [entry, inserted] = d->preparedQueryCache.try_emplace(sqlQuery);
+        if (!inserted) {
+            d->preparedQueryCacheHits++;
+            if (d->currentQuery) {
+                d->currentQuery->preparedQueryCacheHit = true;
+            }
+            // Mark as most recently used
+            d->preparedQueries.splice(d->preparedQueries.begin(), d->preparedQueries, entry->second);
+            return entry->second->query;
+        }
+
+        d->preparedQueryCacheMisses++;
+        auto query = prepareUncachedQuery(database, sqlQuery);
+
+        // If this fails, return without caching the query
+        if (!query) {
+            d->preparedQueryCache.erase(entry);
+            return {};
+        }
+
+        // Else, cache the prepared query
+        d->preparedQueries.push_front(CachedQuery { entry->first, *query });
+        entry->second = d->preparedQueries.begin();
+        evictPreparedQuery(*d);
+
+        return query;
+    }
+
+    d->preparedQueryCacheMisses++;
+    return prepareUncachedQuery(database, sqlQuery);
+}
+
+std::optional<QSqlQuery> AsyncSqlDatabase::prepareRegisteredQuery(const QSqlDatabase &database, std::size_t id, const QString &sqlQuery)
+{
+    qCDebug(asyncdatabase) << "Running" << sqlQuery;
+    startQueryTiming(sqlQuery);
+
+    if (d->preparedQueryCacheSize == 0) {
+        d->preparedQueryCacheMisses++;
+        return prepareUncachedQuery(database, sqlQuery);
+    }
+
+    if (id >= d->registeredQueryCache.size()) {
+        d->registeredQueryCache.resize(id + 1);
+    }
+
+    if (const auto entry = d->registeredQueryCache[id]) {
+        d->preparedQueryCacheHits++;
+        if (d->currentQuery) {
+            d->currentQuery->preparedQueryCacheHit = true;
+        }
+        // Mark as most recently used
+        d->preparedQueries.splice(d->preparedQueries.begin(), d->preparedQueries, *entry);
+        return (*entry)->query;
+    }
+
+    d->preparedQueryCacheMisses++;
+    auto query = prepareUncachedQuery(database, sqlQuery);
+    if (!query) {
+        return {};
+    }
+
+    d->preparedQueries.push_front(CachedQuery { sqlQuery, *query, id });
+    d->registeredQueryCache[id] = d->preparedQueries.begin();
+    evictPreparedQuery(*d);
+
+    return query;
+}
+
+std::optional<QSqlQuery> AsyncSqlDatabase::prepareUncachedQuery(const QSqlDatabase &database, const QString &sqlQuery)
+{
+    QSqlQuery query(database);
+
+    // We only ever iterate once over the results, so there is no need for the driver to keep the previous rows around
+    query.setForwardOnly(true);
+
+    if (!query.prepare(sqlQuery)) {
+        printSqlError(query);
+        return {};
+    }
+
+    return query;
+}
+
+bool AsyncSqlDatabase::runQuery(QSqlQuery &query)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const bool succeeded = query.exec();
+    recordExecution(query, start, succeeded);
+
+    if (!succeeded) {
+        printSqlError(query);
+        return false;
+    }
+    return true;
+}
+
+void AsyncSqlDatabase::executeBatchQuery(const QString &sqlQuery, const std::vector<QVariantList> &columns)
+{
+    qCDebug(asyncdatabase) << "Running batch" << sqlQuery;
+    startQueryTiming(sqlQuery);
+
+    // Not cached, as the query would keep all bound values alive
+    QSqlQuery query(d->database);
+    if (!query.prepare(sqlQuery)) {
+        printSqlError(query);
+        return;
+    }
+
+    for (size_t i = 0; i < columns.size(); i++) {
+        query.bindValue(int(i), columns[i]);
+    }
+
+    // Only manage the transaction if the caller didn't already open one
+    commitGroup();
+    const bool ownTransaction = d->database.transaction();
+    const auto start = std::chrono::steady_clock::now();
+    const bool succeeded = query.execBatch();
+    recordExecution(query, start, succeeded);
+    if (!succeeded) {
+        printSqlError(query);
+        if (ownTransaction) {
+            d->database.rollback();
+        }
+        return;
+    }
+
+    // A failed commit would otherwise leave the transaction open for the next job
+    if (ownTransaction && !d->database.commit()) {
+        qCWarning(asyncdatabase) << "Failed to commit batch" << sqlQuery << d->database.lastError().text();
+        d->database.rollback();
+        if (d->currentQuery) {
+            d->currentQuery->succeeded = false;
+        }
+    }
+}
+
+bool AsyncSqlDatabase::beginTransaction()
+{
+    commitGroup();
+    if (!d->database.transaction()) {
+        qCDebug(asyncdatabase) << "Failed to begin transaction:" << d->database.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool AsyncSqlDatabase::finishTransaction(bool commit)
+{
+    if (commit) {
+        if (d->database.commit()) {
+            return true;
+        }
+        qCDebug(asyncdatabase) << "Failed to commit transaction:" << d->database.lastError().text();
+    }
+
+    if (!d->database.rollback()) {
+        qCDebug(asyncdatabase) << "Failed to roll back transaction:" << d->database.lastError().text();
+    }
+    return false;
+}
+
+QFuture<bool> AsyncSqlDatabase::pipelineCommit(std::vector<PipelineStep> steps)
+{
+    return runPipeline<bool>(std::move(steps), [](const PipelineState &, bool &result) {
+        result = true;
+        return true;
+    });
+}
+
+bool AsyncSqlDatabase::runPipelineSteps(const std::vector<PipelineStep> &steps, PipelineState &state)
+{
+    for (const auto &step : steps) {
+        auto query = executePipelineStep(step, state);
+        if (!query) {
+            return false;
+        }
+
+        PipelineState::StepResult result;
+        if (step.kind == PipelineStep::Kind::Execute) {
+            result.insertId = query->lastInsertId();
+            state.lastInsertId = result.insertId;
+        } else if (query->next()) {
+            for (int i = 0; i < query->record().count(); i++) {
+                result.row.append(query->value(i));
+            }
+        }
+        query->finish();
+        state.steps.push_back(std::move(result));
+    }
+    return true;
+}
+
+// Returns nothing if the step that the value refers to didn't run, or didn't produce it
+static std::optional<QVariant> resolvePipelineValue(const PipelineValue &reference, const PipelineState &state)
+{
+    switch (reference.kind) {
+    case PipelineValue::Kind::LastInsertId:
+        return state.lastInsertId;
+    case PipelineValue::Kind::InsertId:
+        if (reference.step < state.steps.size()) {
+            return state.steps[reference.step].insertId;
+        }
+        return {};
+    case PipelineValue::Kind::Column:
+        // A fetchRow step that found no row has no columns
+        if (reference.step < state.steps.size() && reference.column >= 0
+                && reference.column < state.steps[reference.step].row.size()) {
+            return state.steps[reference.step].row[reference.column];
+        }
+        return {};
+    }
+    Q_UNREACHABLE();
+}
+
+std::optional<QSqlQuery> AsyncSqlDatabase::executePipelineStep(const PipelineStep &step, const PipelineState &state)
+{
+    auto query = prepareQuery(db(), step.sql);
+    if (!query) {
+        return {};
+    }
+
+    for (size_t i = 0; i < step.arguments.size(); i++) {
+        if (const auto *constant = std::get_if<QVariant>(&step.arguments[i])) {
+            query->bindValue(int(i), *constant);
+            continue;
+        }
+
+        // Binding NULL instead would silently write wrong values
+        const auto value = resolvePipelineValue(std::get<PipelineValue>(step.arguments[i]), state);
+        if (!value) {
+            qCWarning(asyncdatabase) << "Pipeline step" << step.sql << "refers to a value that is not available, rolling back";
+            return {};
+        }
+        query->bindValue(int(i), *value);
+    }
+
+    if (!runQuery(*query)) {
+        return {};
+    }
+    return query;
+}
+
+// Marks files written by exportTo in the binary format
+static constexpr quint32 binaryFileMagic = 0x46535131;
+
+static QIODevice *openTransferTarget(const TransferTarget &target, QIODevice::OpenMode mode, std::unique_ptr<QFile> &file)
+{
+    if (const auto *device = std::get_if<QIODevice *>(&target)) {
+        if (!*device || !(*device)->isOpen()) {
+            qCDebug(asyncdatabase) << "The device for the import or export needs to be open";
+            return nullptr;
+        }
+        return *device;
+    }
+
+    file = std::make_unique<QFile>(std::get<QString>(target));
+    if (!file->open(mode)) {
+        qCDebug(asyncdatabase) << "Failed to open" << file->fileName() << file->errorString();
+        return nullptr;
+    }
+    return file.get();
+}
+
+static void useUtf8(QTextStream &stream)
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    stream.setCodec("UTF-8");
+#else
+    // UTF-8 is the default
+    Q_UNUSED(stream)
+#endif
+}
+
+// Text files can't hold arbitrary bytes, so blobs are written as \x followed by their bytes in hex
+static bool isBlob(const QVariant &value)
+{
+    return value.userType() == QMetaType::QByteArray;
+}
+
+static QString blobToText(const QByteArray &bytes)
+{
+    return QStringLiteral("\\x") + QString::fromLatin1(bytes.toHex());
+}
+
+static bool isBlobText(const QString &text)
+{
+    return text.startsWith(QStringLiteral("\\x"));
+}
+
+static QVariant blobFromText(const QString &text)
+{
+    QByteArray bytes = QByteArray::fromHex(QStringView(text).mid(2).toLatin1());
+    // A null byte array would be bound as NULL
+    return bytes.isNull() ? QByteArray("") : bytes;
+}
+
+static void writeCsvRecord(QTextStream &stream, const QVariantList &values)
+{
+    for (qsizetype i = 0; i < values.size(); i++) {
+        if (i > 0) {
+            stream << ',';
+        }
+
+        // NULL is an empty field
+        if (values[i].isNull()) {
+            continue;
+        }
+
+        if (isBlob(values[i])) {
+            stream << blobToText(values[i].toByteArray());
+            continue;
+        }
+
+        // Text that looks like a blob is quoted, so it is read back as text
+        QString text = values[i].toString();
+        if (text.isEmpty() || isBlobText(text) || text.contains(u',') || text.contains(u'"') || text.contains(u'\n') || text.contains(u'\r')) {
+            text.replace(QStringLiteral("\""), QStringLiteral("\"\""));
+            stream << '"' << text << '"';
+        } else {
+            stream << text;
+        }
+    }
+    stream << '\n';
+}
+
+// An empty field is NULL and a field starting with \x is a blob, unless it is quoted
+static QVariant csvField(const QString &field, bool quoted)
+{
+    if (field.isEmpty()) {
+        return quoted ? QVariant(QStringLiteral("")) : QVariant();
+    }
+    if (!quoted && isBlobText(field)) {
+        return blobFromText(field);
+    }
+    return field;
+}
+
+// Reads CSV records character by character, so line breaks in quoted fields keep their exact characters
+class CsvReader {
+public:
+    explicit CsvReader(QTextStream &stream)
+        : m_stream(stream)
+    {
+    }
+
+    // Reads one record, which spans several lines if a quoted field contains line breaks
+    bool readRecord(QVariantList &record) {
+        record.clear();
+        if (!fill()) {
+            return false;
+        }
+
+        QString field;
+        bool inQuotes = false;
+        // Distinguishes an empty string from NULL
+        bool quoted = false;
+        while (fill()) {
+            const QChar c = m_buffer[m_position++];
+            if (inQuotes) {
+                if (c != u'"') {
+                    field.append(c);
+                } else if (fill() && m_buffer[m_position] == u'"') {
+                    field.append(c);
+                    m_position++;
+                } else {
+                    inQuotes = false;
+                }
+            } else if (c == u'"') {
+                inQuotes = true;
+                quoted = true;
+            } else if (c == u',') {
+                record.append(csvField(field, quoted));
+                field.clear();
+                quoted = false;
+            } else if (c == u'\n') {
+                break;
+            } else if (c != u'\r') {
+                // Outside of quotes, a carriage return can only be part of a CRLF line break
+                field.append(c);
+            }
+        }
+        record.append(csvField(field, quoted));
+        return true;
+    }
+
+private:
+    // Whether there is a character left to read
+    bool fill() {
+        if (m_position < m_buffer.size()) {
+            return true;
+        }
+        if (m_stream.atEnd()) {
+            return false;
+        }
+
+        m_buffer = m_stream.read(64 * 1024);
+        m_position = 0;
+        return !m_buffer.isEmpty();
+    }
+
+    QTextStream &m_stream;
+    QString m_buffer;
+    qsizetype m_position = 0;
+};
+
+static void writeTsvRecord(QTextStream &stream, const QVariantList &values)
+{
+    for (qsizetype i = 0; i < values.size(); i++) {
+        if (i > 0) {
+            stream << '\t';
+        }
+
+        if (values[i].isNull()) {
+            stream << QStringLiteral("\\N");
+            continue;
+        }
+
+        if (isBlob(values[i])) {
+            stream << blobToText(values[i].toByteArray());
+            continue;
+        }
+
+        // Backslashes in text are escaped, so text never starts with \x
+        QString text = values[i].toString();
+        text.replace(QStringLiteral("\\"), QStringLiteral("\\\\"));
+        text.replace(QStringLiteral("\t"), QStringLiteral("\\t"));
+        text.replace(QStringLiteral("\n"), QStringLiteral("\\n"));
+        text.replace(QStringLiteral("\r"), QStringLiteral("\\r"));
+        stream << text;
+    }
+    stream << '\n';
+}
+
+static QVariant parseTsvField(const QString &field)
+{
+    if (field == QStringLiteral("\\N")) {
+        return {};
+    }
+    if (isBlobText(field)) {
+        return blobFromText(field);
+    }
+
+    QString value;
+    value.reserve(field.size());
+    for (qsizetype i = 0; i < field.size(); i++) {
+        if (field[i] != u'\\' || i + 1 == field.size()) {
+            value.append(field[i]);
+            continue;
+        }
+
+        i++;
+        switch (field[i].unicode()) {
+        case u't':
+            value.append(u'\t');
+            break;
+        case u'n':
+            value.append(u'\n');
+            break;
+        case u'r':
+            value.append(u'\r');
+            break;
+        case u'\\':
+            value.append(u'\\');
+            break;
+        default:
+            value.append(u'\\');
+            value.append(field[i]);
+        }
+    }
+    // An empty field is an empty string, not NULL
+    return value.isNull() ? QStringLiteral("") : value;
+}
+
+static bool readTsvRecord(QTextStream &stream, QVariantList &record)
+{
+    record.clear();
+    if (stream.atEnd()) {
+        return false;
+    }
+
+    const QString line = stream.readLine();
+    qsizetype start = 0;
+    while (true) {
+        const qsizetype end = line.indexOf(u'\t', start);
+        record.append(parseTsvField(line.mid(start, end < 0 ? -1 : end - start)));
+        if (end < 0) {
+            return true;
+        }
+        start = end + 1;
+    }
+}
+
+void AsyncSqlDatabase::reportProgress(int value)
+{
+    if (d->currentJob) {
+        d->currentJob->setProgressValue(value);
+    }
+}
+
+bool AsyncSqlDatabase::insertBatch(QSqlQuery &query, const QString &sqlQuery, std::vector<QVariantList> &columns)
+{
+    startQueryTiming(sqlQuery);
+    for (size_t i = 0; i < columns.size(); i++) {
+        query.bindValue(int(i), columns[i]);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const bool succeeded = query.execBatch();
+    recordExecution(query, start, succeeded);
+    if (!succeeded) {
+        printSqlError(query);
+    }
+
+    for (auto &column : columns) {
+        column.clear();
+    }
+    return succeeded;
+}
+
+quint64 AsyncSqlDatabase::importRows(const TransferTarget &source, const QString &table, const ImportOptions &options)
+{
+    std::unique_ptr<QFile> file;
+    QIODevice *device = openTransferTarget(source, QIODevice::ReadOnly, file);
+    if (!device) {
+        return 0;
+    }
+
+    QTextStream text;
+    std::optional<CsvReader> csv;
+    QDataStream data;
+    QStringList columnNames;
+    // Reads the next record, returns false at the end of the file or if it is corrupt
+    std::function<bool (QVariantList &)> readRecord;
+    bool corrupt = false;
+
+    switch (options.format) {
+    case FileFormat::Csv:
+    case FileFormat::Tsv:
+        text.setDevice(device);
+        useUtf8(text);
+        if (options.format == FileFormat::Csv) {
+            csv.emplace(text);
+            readRecord = [&csv](QVariantList &record) {
+                return csv->readRecord(record);
+            };
+        } else {
+            readRecord = [&text](QVariantList &record) {
+                return readTsvRecord(text, record);
+            };
+        }
+
+        if (options.header) {
+            QVariantList header;
+            if (!readRecord(header)) {
+                return 0;
+            }
+            for (const auto &name : std::as_const(header)) {
+                columnNames.append(name.toString());
+            }
+        }
+        break;
+    case FileFormat::Binary: {
+        data.setDevice(device);
+        data.setVersion(QDataStream::Qt_5_15);
+        quint32 magic = 0;
+        data >> magic >> columnNames;
+        if (data.status() != QDataStream::Ok || magic != binaryFileMagic) {
+            qCDebug(asyncdatabase) << "Not a file that was exported in the binary format";
+            return 0;
+        }
+
+        readRecord = [&data, &columnNames, &corrupt](QVariantList &record) {
+            record.clear();
+            quint8 hasRecord = 0;
+            data >> hasRecord;
+            for (qsizetype i = 0; hasRecord && i < columnNames.size(); i++) {
+                QVariant value;
+                data >> value;
+                record.append(std::move(value));
+            }
+            corrupt = data.status() != QDataStream::Ok;
+            return hasRecord && !corrupt;
+        };
+        break;
+    }
+    }
+
+    QVariantList record;
+    bool hasRecord = readRecord(record);
+    if (!hasRecord) {
+        if (corrupt) {
+            qCDebug(asyncdatabase) << "Failed to read the first record to import into" << table;
+        }
+        return 0;
+    }
+    const qsizetype columnCount = columnNames.isEmpty() ? record.size() : columnNames.size();
+    if (columnCount == 0) {
+        qCDebug(asyncdatabase) << "No columns to import into" << table;
+        return 0;
+    }
+
+    const QSqlDriver *driver = d->database.driver();
+    QString sqlQuery = QStringLiteral("INSERT INTO ") % driver->escapeIdentifier(table, QSqlDriver::TableName);
+    if (!columnNames.isEmpty()) {
+        QStringList escapedNames;
+        for (const auto &name : std::as_const(columnNames)) {
+            escapedNames.append(driver->escapeIdentifier(name, QSqlDriver::FieldName));
+        }
+        sqlQuery += QStringLiteral(" (") % escapedNames.join(QStringLiteral(", ")) % QLatin1Char(')');
+    }
+    sqlQuery += QStringLiteral(" VALUES (?") % QStringLiteral(", ?").repeated(columnCount - 1) % QLatin1Char(')');
+
+    qCDebug(asyncdatabase) << "Importing into" << table;
+    auto query = prepareUncachedQuery(d->database, sqlQuery);
+    if (!query || !beginTransaction()) {
+        return 0;
+    }
+
+    const qint64 size = device->isSequential() ? 0 : device->size();
+    if (size > 0 && d->currentJob) {
+        d->currentJob->setProgressRange(0, 100);
+    }
+
+    const std::size_t batchSize = std::max<std::size_t>(options.batchSize, 1);
+    std::vector<QVariantList> columns(columnCount);
+    for (auto &column : columns) {
+        column.reserve(qsizetype(batchSize));
+    }
+    std::size_t batchRows = 0;
+    quint64 uncommitted = 0;
+    quint64 committed = 0;
+    bool failed = false;
+
+    while (hasRecord) {
+        if (record.size() != columnCount) {
+            qCDebug(asyncdatabase) << "Record" << committed + uncommitted + batchRows + 1 << "has" << record.size() << "values instead of" << columnCount;
+            failed = true;
+            break;
+        }
+
+        for (qsizetype i = 0; i < columnCount; i++) {
+            columns[i].append(std::move(record[i]));
+        }
+        batchRows++;
+
+        if (batchRows == batchSize) {
+            if (!insertBatch(*query, sqlQuery, columns) || isCurrentJobCanceled()) {
+                failed = true;
+                break;
+            }
+            uncommitted += std::exchange(batchRows, 0);
+
+            if (uncommitted >= options.commitInterval) {
+                if (!finishTransaction(true)) {
+                    return committed;
+                }
+                committed += std::exchange(uncommitted, 0);
+                if (!beginTransaction()) {
+                    return committed;
+                }
+            }
+
+            if (size > 0) {
+                reportProgress(int(device->pos() * 100 / size));
+            } else {
+                reportProgress(int(std::min<quint64>(committed + uncommitted, INT_MAX)));
+            }
+        }
+
+        hasRecord = readRecord(record);
+    }
+
+    if (corrupt) {
+        qCDebug(asyncdatabase) << "Failed to read record" << committed + uncommitted + batchRows + 1 << "to import into" << table;
+        failed = true;
+    }
+
+    if (!failed && batchRows > 0) {
+        failed = !insertBatch(*query, sqlQuery, columns);
+        uncommitted += batchRows;
+    }
+
+    if (finishTransaction(!failed)) {
+        committed += uncommitted;
+    }
+    return committed;
+}
+
+quint64 AsyncSqlDatabase::exportRows(const TransferTarget &target, FileFormat format, QSqlQuery &query)
+{
+    std::unique_ptr<QFile> file;
+    QIODevice *device = openTransferTarget(target, QIODevice::WriteOnly | QIODevice::Truncate, file);
+    if (!device) {
+        query.finish();
+        return 0;
+    }
+
+    const QSqlRecord columns = query.record();
+    const int columnCount = columns.count();
+
+    QTextStream text;
+    QDataStream data;
+    std::function<void (const QVariantList &)> writeRecord;
+
+    switch (format) {
+    case FileFormat::Csv:
+    case FileFormat::Tsv: {
+        text.setDevice(device);
+        useUtf8(text);
+        writeRecord = [&text, format](const QVariantList &record) {
+            if (format == FileFormat::Csv) {
+                writeCsvRecord(text, record);
+            } else {
+                writeTsvRecord(text, record);
+            }
+        };
+
+        QVariantList header;
+        for (int i = 0; i < columnCount; i++) {
+            header.append(columns.fieldName(i));
+        }
+        writeRecord(header);
+        break;
+    }
+    case FileFormat::Binary: {
+        data.setDevice(device);
+        data.setVersion(QDataStream::Qt_5_15);
+
+        QStringList columnNames;
+        for (int i = 0; i < columnCount; i++) {
+            columnNames.append(columns.fieldName(i));
+        }
+        data << binaryFileMagic << columnNames;
+
+        writeRecord = [&data](const QVariantList &record) {
+            data << quint8(1);
+            for (const auto &value : record) {
+                data << value;
+            }
+        };
+        break;
+    }
+    }
+
+    // Most drivers, including SQLite, don't know the number of rows up front.
+    // Without a range, the progress value is just the number of rows written so far.
+    if (query.size() > 0 && d->currentJob) {
+        d->currentJob->setProgressRange(0, query.size());
+    }
+
+    quint64 rows = 0;
+    fetchRows(query, [columnCount](const QSqlQuery &query) {
+        QVariantList record;
+        record.reserve(columnCount);
+        for (int i = 0; i < columnCount; i++) {
+            record.append(query.value(i));
+        }
+        return record;
+    }, [&](QVariantList &&record) {
+        writeRecord(record);
+        if (++rows % 1000 == 0) {
+            reportProgress(int(std::min<quint64>(rows, INT_MAX)));
+            // Stop early if the device is full, for example
+            return format == FileFormat::Binary ? data.status() == QDataStream::Ok : text.status() == QTextStream::Ok;
+        }
+        return true;
+    });
+    query.finish();
+
+    bool written = true;
+    if (format == FileFormat::Binary) {
+        // Marks the end, so a truncated file can be told apart
+        data << quint8(0);
+        written = data.status() == QDataStream::Ok;
+    } else {
+        text.flush();
+        written = text.status() == QTextStream::Ok;
+    }
+
+    if (!written) {
+        qCWarning(asyncdatabase) << "Failed to write the export:" << device->errorString();
+        return 0;
+    }
+    reportProgress(int(std::min<quint64>(rows, INT_MAX)));
+    return rows;
+}
+
+QFuture<quint64> AsyncSqlDatabase::importFrom(TransferTarget source, const QString &table, const ImportOptions &options)
+{
+    return runAsync([this, source = std::move(source), table, options] {
+        return importRows(source, table, options);
+    });
+}
+
+void AsyncSqlDatabase::rollbackAfterException(std::exception_ptr exception)
+{
+    try {
+        std::rethrow_exception(exception);
+    } catch (const std::exception &e) {
+        qCDebug(asyncdatabase) << "Rolling back transaction after exception:" << e.what();
+    } catch (...) {
+        qCDebug(asyncdatabase) << "Rolling back transaction after unknown exception";
+    }
+    finishTransaction(false);
+}
+
+}
+
+struct DatabaseConfigurationPrivate : public QSharedData {
+    QString type;
+    std::optional<QString> hostName;
+    std::optional<QString> databaseName;
+    std::optional<QString> userName;
+    std::optional<QString> password;
+    int readConnectionCount = 0;
+    std::size_t preparedQueryCacheSize = 256;
+    std::size_t resultCacheSize = 0;
+    std::optional<std::chrono::milliseconds> groupCommitWindow;
+    std::size_t groupCommitMaxStatements = 1000;
+    std::size_t maxQueuedJobs = 0;
+    QueueFullPolicy queueFullPolicy = QueueFullPolicy::Block;
+    std::shared_ptr<DatabaseThreadPool> threadPool;
+    bool collectStatistics = false;
+    std::function<void (const QueryTiming &)> queryObserver;
+    std::optional<std::chrono::milliseconds> slowQueryThreshold;
+    std::size_t slowQueryLogSize = 100;
+    std::optional<QString> connectOptions;
+    QStringList initStatements;
+    std::optional<SqliteJournalMode> journalMode;
+    std::optional<SqliteSynchronous> synchronous;
+    std::optional<qint64> mmapSize;
+    std::optional<qint64> cacheSize;
+    std::optional<SqliteTempStore> tempStore;
+    std::optional<std::chrono::milliseconds> busyTimeout;
+};
+
+DatabaseConfiguration::DatabaseConfiguration() : d(new DatabaseConfigurationPrivate)
+{}
+
+DatabaseConfiguration::~DatabaseConfiguration() = default;
+DatabaseConfiguration::DatabaseConfiguration(const DatabaseConfiguration &) = default;
+
+void DatabaseConfiguration::setType(const QString &type) {
+    d->type = type;
+}
+
+const QString &DatabaseConfiguration::type() const {
+    return d->type;
+}
+
+void DatabaseConfiguration::setHostName(const QString &hostName) {
+    d->hostName = hostName;
+}
+
+const std::optional<QString> &DatabaseConfiguration::hostName() const {
+    return d->hostName;
+}
+
+void DatabaseConfiguration::setDatabaseName(const QString &databaseName) {
+    d->databaseName = databaseName;
+}
+
+const std::optional<QString> &DatabaseConfiguration::databaseName() const {
+    return d->databaseName;
+}
+
+void DatabaseConfiguration::setUserName(const QString &userName) {
+    d->userName = userName;
+}
+
+const std::optional<QString> &DatabaseConfiguration::userName() const {
+    return d->userName;
+}
+
+void DatabaseConfiguration::setPassword(const QString &password) {
+    d->password = password;
+}
+
+const std::optional<QString> &DatabaseConfiguration::password() const {
+    return d->password;
+}
+
+void DatabaseConfiguration::setReadConnectionCount(int count) {
+    d->readConnectionCount = count;
+}
+
+int DatabaseConfiguration::readConnectionCount() const {
+    return d->readConnectionCount;
+}
+
+void DatabaseConfiguration::setPreparedQueryCacheSize(std::size_t size) {
+    d->preparedQueryCacheSize = size;
+}
+
+std::size_t DatabaseConfiguration::preparedQueryCacheSize() const {
+    return d->preparedQueryCacheSize;
+}
+
+void DatabaseConfiguration::setResultCacheSize(std::size_t rows) {
+    d->resultCacheSize = rows;
+}
+
+std::size_t DatabaseConfiguration::resultCacheSize() const {
+    return d->resultCacheSize;
+}
+
+void DatabaseConfiguration::setGroupCommitWindow(std::chrono::milliseconds window) {
+    d->groupCommitWindow = window;
+}
+
+const std::optional<std::chrono::milliseconds> &DatabaseConfiguration::groupCommitWindow() const {
+    return d->groupCommitWindow;
+}
+
+void DatabaseConfiguration::setGroupCommitMaxStatements(std::size_t count) {
+    d->groupCommitMaxStatements = count;
+}
+
+std::size_t DatabaseConfiguration::groupCommitMaxStatements() const {
+    return d->groupCommitMaxStatements;
+}
+
+void DatabaseConfiguration::setMaxQueuedJobs(std::size_t count) {
+    d->maxQueuedJobs = count;
+}
+
+std::size_t DatabaseConfiguration::maxQueuedJobs() const {
+    return d->maxQueuedJobs;
+}
+
+void DatabaseConfiguration::setQueueFullPolicy(QueueFullPolicy policy) {
+    d->queueFullPolicy = policy;
+}
+
+QueueFullPolicy DatabaseConfiguration::queueFullPolicy() const {
+    return d->queueFullPolicy;
+}
+
+void DatabaseConfiguration::setThreadPool(std::shared_ptr<DatabaseThreadPool> pool) {
+    d->threadPool = std::move(pool);
+}
+
+const std::shared_ptr<DatabaseThreadPool> &DatabaseConfiguration::threadPool() const {
+    return d->threadPool;
+}
+
+void DatabaseConfiguration::setCollectStatistics(bool collect) {
+    d->collectStatistics = collect;
+}
+
+bool DatabaseConfiguration::collectStatistics() const {
+    return d->collectStatistics;
+}
+
+void DatabaseConfiguration::setQueryObserver(std::function<void (const QueryTiming &)> observer) {
+    d->queryObserver = std::move(observer);
+}
+
+const std::function<void (const QueryTiming &)> &DatabaseConfiguration::queryObserver() const {
+    return d->queryObserver;
+}
+
+void DatabaseConfiguration::setSlowQueryThreshold(std::chrono::milliseconds threshold) {
+    d->slowQueryThreshold = threshold;
+}
+
+const std::optional<std::chrono::milliseconds> &DatabaseConfiguration::slowQueryThreshold() const {
+    return d->slowQueryThreshold;
+}
+
+void DatabaseConfiguration::setSlowQueryLogSize(std::size_t size) {
+    d->slowQueryLogSize = size;
+}
+
+std::size_t DatabaseConfiguration::slowQueryLogSize() const {
+    return d->slowQueryLogSize;
+}
+
+void DatabaseConfiguration::setConnectOptions(const QString &options) {
+    d->connectOptions = options;
+}
+
+const std::optional<QString> &DatabaseConfiguration::connectOptions() const {
+    return d->connectOptions;
+}
+
+void DatabaseConfiguration::setInitStatements(const QStringList &statements) {
+    d->initStatements = statements;
+}
+
+const QStringList &DatabaseConfiguration::initStatements() const {
+    return d->initStatements;
+}
+
+void DatabaseConfiguration::setJournalMode(SqliteJournalMode mode) {
+    d->journalMode = mode;
+}
+
+const std::optional<SqliteJournalMode> &DatabaseConfiguration::journalMode() const {
+    return d->journalMode;
+}
+
+void DatabaseConfiguration::setSynchronous(SqliteSynchronous synchronous) {
+    d->synchronous = synchronous;
+}
+
+const std::optional<SqliteSynchronous> &DatabaseConfiguration::synchronous() const {
+    return d->synchronous;
+}
+
+void DatabaseConfiguration::setMmapSize(qint64 bytes) {
+    d->mmapSize = bytes;
+}
+
+const std::optional<qint64> &DatabaseConfiguration::mmapSize() const {
+    return d->mmapSize;
+}
+
+void DatabaseConfiguration::setCacheSize(qint64 size) {
+    d->cacheSize = size;
+}
+
+const std::optional<qint64> &DatabaseConfiguration::cacheSize() const {
+    return d->cacheSize;
+}
+
+void DatabaseConfiguration::setTempStore(SqliteTempStore tempStore) {
+    d->tempStore = tempStore;
+}
+
+const std::optional<SqliteTempStore> &DatabaseConfiguration::tempStore() const {
+    return d->tempStore;
+}
+
+void DatabaseConfiguration::setBusyTimeout(std::chrono::milliseconds timeout) {
+    d->busyTimeout = timeout;
+}
+
+const std::optional<std::chrono::milliseconds> &DatabaseConfiguration::busyTimeout() const {
+    return d->busyTimeout;
+}
+
+void LatencyHistogram::add(std::chrono::nanoseconds duration)
+{
+    const auto microseconds = quint64(std::max<qint64>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count(), 0));
+    const auto bucket = std::min<std::size_t>(std::bit_width(microseconds), buckets.size() - 1);
+    buckets[bucket]++;
+    count++;
+    total += duration;
+    max = std::max(max, duration);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (std::size_t i = 0; i < buckets.size(); i++) {
+        buckets[i] += other.buckets[i];
+    }
+    count += other.count;
+    total += other.total;
+    max = std::max(max, other.max);
+}
+
+std::chrono::microseconds LatencyHistogram::percentile(double fraction) const
+{
+    const auto target = quint64(std::ceil(fraction * double(count)));
+    quint64 seen = 0;
+    for (std::size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= target && seen > 0) {
+            return std::chrono::microseconds(qint64(1) << i);
+        }
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(max);
+}
+
+
+// A read-only connection with its own thread
+struct ReadConnection {
+    ~ReadConnection() {
+        thread.quit();
+        thread.wait();
+    }
+
+    QThread thread;
+    asyncdatabase_private::AsyncSqlDatabase db;
+};
+
+struct DatabaseThreadPoolPrivate {
+    std::vector<std::unique_ptr<QThread>> threads;
+    mutable std::mutex mutex;
+    // The connections on each thread, indexed like threads
+    std::vector<std::vector<asyncdatabase_private::AsyncSqlDatabase *>> connections;
+};
+
+DatabaseThreadPool::DatabaseThreadPool(int threadCount)
+    : d(std::make_unique<DatabaseThreadPoolPrivate>())
+{
+    threadCount = std::max(threadCount, 1);
+    for (int i = 0; i < threadCount; i++) {
+        auto thread = std::make_unique<QThread>();
+        thread->setObjectName(QStringLiteral("database pool thread"));
+        thread->start();
+        d->threads.push_back(std::move(thread));
+    }
+    d->connections.resize(threadCount);
+}
+
+DatabaseThreadPool::~DatabaseThreadPool()
+{
+    for (auto &thread : d->threads) {
+        thread->quit();
+    }
+    for (auto &thread : d->threads) {
+        // The last database using the pool can be destroyed on one of its threads, which can't wait for itself.
+        // That thread finishes once the current event returned, and deletes itself then.
+        if (thread.get() == QThread::currentThread()) {
+            QThread *current = thread.release();
+            QObject::connect(current, &QThread::finished, current, &QObject::deleteLater);
+            continue;
+        }
+        thread->wait();
+    }
+}
+
+int DatabaseThreadPool::threadCount() const
+{
+    return int(d->threads.size());
+}
+
+std::vector<int> DatabaseThreadPool::connectionCounts() const
+{
+    std::lock_guard lock(d->mutex);
+    std::vector<int> counts;
+    counts.reserve(d->connections.size());
+    for (const auto &connections : d->connections) {
+        counts.push_back(int(connections.size()));
+    }
+    return counts;
+}
+
+QThread *DatabaseThreadPool::acquireThread(asyncdatabase_private::AsyncSqlDatabase *connection)
+{
+    std::lock_guard lock(d->mutex);
+    // Connections are balanced first, as they stay on their thread. Of threads with as many connections,
+    // the one with the fewest queued jobs is the least busy right now.
+    auto load = [](const std::vector<asyncdatabase_private::AsyncSqlDatabase *> &connections) {
+        int pendingJobs = 0;
+        for (const auto *poolConnection : connections) {
+            pendingJobs += std::max(poolConnection->pendingJobs(), 0);
+        }
+        return std::pair(connections.size(), pendingJobs);
+    };
+    const auto index = std::ranges::min_element(d->connections, {}, load) - d->connections.begin();
+    d->connections[index].push_back(connection);
+    return d->threads[index].get();
+}
+
+void DatabaseThreadPool::releaseThread(asyncdatabase_private::AsyncSqlDatabase *connection)
+{
+    std::lock_guard lock(d->mutex);
+    for (auto &connections : d->connections) {
+        std::erase(connections, connection);
+    }
+}
+
+bool DatabaseThreadPool::hasThread(const QThread *thread) const
+{
+    return std::ranges::any_of(d->threads, [thread](const auto &poolThread) {
+        return poolThread.get() == thread;
+    });
+}
+
+struct ThreadedDatabasePrivate {
+    template <typename Func>
+    void forEachConnection(Func func) {
+        func(db);
+        for (auto &connection : readConnections) {
+            func(connection->db);
+        }
+    }
+
+    // Moves a connection to a thread of the pool, or else starts the thread of its own
+    void attach(asyncdatabase_private::AsyncSqlDatabase &connection, QThread &ownThread) {
+        if (threadPool) {
+            connection.moveToThread(threadPool->acquireThread(&connection));
+        } else {
+            connection.moveToThread(&ownThread);
+            ownThread.start();
+        }
+    }
+
+    void detach() {
+        if (threadPool) {
+            forEachConnection([this](auto &connection) {
+                threadPool->releaseThread(&connection);
+            });
+        }
+    }
+
+    asyncdatabase_private::AsyncSqlDatabase db;
+    std::vector<std::unique_ptr<ReadConnection>> readConnections;
+    std::shared_ptr<asyncdatabase_private::ResultCache> resultCache;
+    std::shared_ptr<DatabaseThreadPool> threadPool;
+};
+
+// Whether every connection to the SQLite database gets its own separate database:
+// an in-memory database, also when opened as a URI, or a temporary one for an empty name
+static bool isPrivateDatabase(const DatabaseConfiguration &config)
+{
+    if (config.type() != DATABASE_TYPE_SQLITE) {
+        return false;
+    }
+
+    const QString name = config.databaseName().value_or(QString());
+    return name.isEmpty()
+        || name == QStringLiteral(":memory:")
+        || name.startsWith(QStringLiteral("file::memory:"))
+        || (name.startsWith(QStringLiteral("file:")) && name.contains(QStringLiteral("mode=memory")));
+}
+
+std::unique_ptr<ThreadedDatabase> ThreadedDatabase::establishConnection(const DatabaseConfiguration &config) {
+    auto threadedDb = std::make_unique<ThreadedDatabase>();
+    threadedDb->setObjectName(QStringLiteral("database thread"));
+    threadedDb->d->threadPool = config.threadPool();
+    threadedDb->d->attach(threadedDb->d->db, *threadedDb);
+
+    // In rollback journal mode, a read connection can see the previous state of the database after the commit hook
+    // invalidated the cache, and nothing would invalidate what it stores then.
+    const bool hasReadConnections = config.readConnectionCount() > 0 && !isPrivateDatabase(config);
+    if (config.resultCacheSize() > 0 && hasReadConnections && config.journalMode() != SqliteJournalMode::Wal) {
+        qCDebug(asyncdatabase) << "The result cache needs SqliteJournalMode::Wal when using read connections, it is disabled";
+    } else if (config.resultCacheSize() > 0) {
+        threadedDb->d->resultCache = std::make_shared<asyncdatabase_private::ResultCache>(config.resultCacheSize());
+        threadedDb->d->db.setResultCache(threadedDb->d->resultCache);
+    }
+    threadedDb->d->db.establishConnection(config);
+
+    // Read connections would not see the tables and rows of the main connection
+    if (!isPrivateDatabase(config)) {
+        for (int i = 0; i < config.readConnectionCount(); i++) {
+            auto connection = std::make_unique<ReadConnection>();
+            connection->thread.setObjectName(QStringLiteral("database read thread"));
+            threadedDb->d->attach(connection->db, connection->thread);
+            connection->db.setResultCache(threadedDb->d->resultCache);
+            connection->db.establishConnection(config, true);
+            threadedDb->d->readConnections.push_back(std::move(connection));
+        }
+    }
+
+    return threadedDb;
+}
+
+auto ThreadedDatabase::runMigrations(const QString &migrationDirectory) -> QFuture<void> {
+    return d->db.runMigrations(migrationDirectory);
+}
+
+void ThreadedDatabase::runMigrations(QObject *context, std::function<void ()> callback, const QString &migrationDirectory) {
+    d->db.runMigrations(context, std::move(callback), migrationDirectory);
+}
+
+auto ThreadedDatabase::setCurrentMigrationLevel(const QString &migrationName) -> QFuture<void> {
+    return d->db.setCurrentMigrationLevel(migrationName);
+}
+
+PreparedQueryCacheStatistics ThreadedDatabase::preparedQueryCacheStatistics() const
+{
+    PreparedQueryCacheStatistics statistics;
+    d->forEachConnection([&](auto &db) {
+        const auto connectionStatistics = db.preparedQueryCacheStatistics();
+        statistics.hits += connectionStatistics.hits;
+        statistics.misses += connectionStatistics.misses;
+        statistics.evictions += connectionStatistics.evictions;
+        statistics.size += connectionStatistics.size;
+    });
+    return statistics;
+}
+
+LiveQueryBase::LiveQueryBase(asyncdatabase_private::AsyncSqlDatabase &writer)
+    : m_writer(writer)
+    , m_timer(new QTimer(this))
+{
+    m_timer->setSingleShot(true);
+    m_timer->setInterval(std::chrono::milliseconds(50));
+    connect(m_timer, &QTimer::timeout, this, &LiveQueryBase::runQuery);
+}
+
+LiveQueryBase::~LiveQueryBase()
+{
+    stopWatching();
+}
+
+void LiveQueryBase::stopWatching()
+{
+    // Afterwards the database thread doesn't call tablesChanged anymore
+    if (const auto id = std::exchange(m_watchId, std::nullopt)) {
+        m_writer.unwatchTables(*id);
+    }
+    m_timer->stop();
+}
+
+void LiveQueryBase::setDebounceInterval(std::chrono::milliseconds interval)
+{
+    m_timer->setInterval(interval);
+}
+
+void LiveQueryBase::watch(const QString &sqlQuery)
+{
+    m_watchId = m_writer.watchTables(sqlQuery, [this] {
+        QMetaObject::invokeMethod(this, [this] {
+            tablesChanged();
+        });
+    });
+}
+
+void LiveQueryBase::tablesChanged()
+{
+    // The first call means the tables are watched now
+    if (!m_started) {
+        m_started = true;
+        runQuery();
+        return;
+    }
+
+    // Writes during the interval are covered by the same query
+    if (!m_timer->isActive()) {
+        m_timer->start();
+    }
+}
+
+void LiveQueryBase::runQuery()
+{
+    if (m_running) {
+        m_outdated = true;
+        return;
+    }
+
+    m_running = true;
+    refresh();
+}
+
+void LiveQueryBase::refreshRejected()
+{
+    // The queue of the connection was full, try again once the interval passed
+    m_running = false;
+    m_outdated = false;
+    m_timer->start();
+}
+
+void LiveQueryBase::finishRefresh(bool changed)
+{
+    m_running = false;
+    if (changed) {
+        Q_EMIT resultsChanged();
+    }
+
+    if (std::exchange(m_outdated, false)) {
+        runQuery();
+    }
+}
+
+ResultCacheStatistics ThreadedDatabase::resultCacheStatistics() const
+{
+    if (!d->resultCache) {
+        return {};
+    }
+    return d->resultCache->statistics();
+}
+
+void ThreadedDatabase::clearResultCache()
+{
+    if (d->resultCache) {
+        d->resultCache->clear();
+    }
+}
+
+void ThreadedDatabase::clearPreparedQueryCache()
+{
+    d->forEachConnection([](auto &db) {
+        db.clearPreparedQueryCache();
+    });
+}
+
+std::vector<QueryStatistics> ThreadedDatabase::statistics() const
+{
+    std::unordered_map<QString, QueryStatistics> merged;
+    d->forEachConnection([&](auto &db) {
+        for (auto &queryStatistics : db.statistics()) {
+            auto [entry, inserted] = merged.try_emplace(queryStatistics.sql, queryStatistics);
+            if (!inserted) {
+                asyncdatabase_private::mergeStatistics(entry->second, queryStatistics);
+            }
+        }
+    });
+
+    std::vector<QueryStatistics> statistics;
+    statistics.reserve(merged.size());
+    for (auto &[sql, queryStatistics] : merged) {
+        statistics.push_back(std::move(queryStatistics));
+    }
+    std::ranges::sort(statistics, std::greater {}, [](const QueryStatistics &queryStatistics) {
+        return queryStatistics.total.total;
+    });
+    return statistics;
+}
+
+Pipeline ThreadedDatabase::pipeline()
+{
+    return Pipeline(db());
+}
+
+QFuture<quint64> ThreadedDatabase::importFrom(QIODevice *device, const QString &table, const ImportOptions &options)
+{
+    return db().importFrom(device, table, options);
+}
+
+QFuture<quint64> ThreadedDatabase::importFrom(const QString &filePath, const QString &table, const ImportOptions &options)
+{
+    return db().importFrom(filePath, table, options);
+}
+
+std::vector<SlowQuery> ThreadedDatabase::slowQueries() const
+{
+    std::vector<SlowQuery> slowQueries;
+    d->forEachConnection([&](auto &db) {
+        std::ranges::move(db.slowQueries(), std::back_inserter(slowQueries));
+    });
+    std::ranges::sort(slowQueries, {}, &SlowQuery::time);
+    return slowQueries;
+}
+
+QueueStatistics ThreadedDatabase::queueStatistics() const
+{
+    QueueStatistics statistics;
+    d->forEachConnection([&](auto &db) {
+        const auto connectionStatistics = db.queueStatistics();
+        for (size_t i = 0; i < statistics.lanes.size(); i++) {
+            auto &lane = statistics.lanes[i];
+            const auto &connectionLane = connectionStatistics.lanes[i];
+            lane.jobs += connectionLane.jobs;
+            lane.totalWait += connectionLane.totalWait;
+            lane.maxWait = std::max(lane.maxWait, connectionLane.maxWait);
+        }
+        statistics.depth += connectionStatistics.depth;
+        statistics.highWaterMark = std::max(statistics.highWaterMark, connectionStatistics.highWaterMark);
+        statistics.rejected += connectionStatistics.rejected;
+        statistics.dropped += connectionStatistics.dropped;
+    });
+    return statistics;
+}
+
+ThreadedDatabase::ThreadedDatabase()
+    : QThread()
+    , d(std::make_unique<ThreadedDatabasePrivate>())
+{
+}
+
+ThreadedDatabase::~ThreadedDatabase()
+{
+    d->forEachConnection([this](auto &db) {
+        // Closing waits for the thread of the connection, which may be waiting for this pool thread in turn
+        Q_ASSERT_X(!d->threadPool || !d->threadPool->hasThread(QThread::currentThread()) || db.thread() == QThread::currentThread(),
+                   "~ThreadedDatabase", "A database must not be destroyed on a pool thread that its connections don't live on");
+        db.close();
+    });
+    d->detach();
+    quit();
+    wait();
+}
 
 asyncdatabase_private::AsyncSqlDatabase &ThreadedDatabase::db()
 {
     return d->db;
 }
+
+asyncdatabase_private::AsyncSqlDatabase &ThreadedDatabase::readDb()
+{
+    if (d->readConnections.empty()) {
+        return d->db;
+    }
+
+    const auto connection = std::ranges::min_element(d->readConnections, {}, [](const auto &connection) {
+        return connection->db.pendingJobs();
+    });
+    return (*connection)->db;
+}
@@ -4,15 +4,23 @@
 
 #pragma once
 
+class DatabaseThreadPool;
+class QIODevice;
+class QTimer;
 class QUrl;
 class QSqlDatabase;
 
 #include <QString>
+#include <QStringList>
 #include <QObject>
 #include <QFuture>
 #include <QSharedDataPointer>
 
+#include <array>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <memory_resource>
 #include <optional>
 #include <tuple>
 #include <vector>
@@ -23,6 +31,51 @@ class QSqlDatabase;
 
 struct DatabaseConfigurationPrivate;
 
+///
+/// How SQLite keeps the journal that makes transactions atomic
+///
+enum class SqliteJournalMode {
+    Delete,
+    Truncate,
+    Persist,
+    Memory,
+    /// Write-ahead log, which allows reading while another connection writes
+    Wal,
+    Off,
+};
+
+///
+/// How often SQLite waits for data to reach the disk
+///
+enum class SqliteSynchronous {
+    Off,
+    /// Safe in WAL mode, but a transaction may be rolled back after a power loss
+    Normal,
+    Full,
+    Extra,
+};
+
+///
+/// Where SQLite keeps temporary tables and indices
+///
+enum class SqliteTempStore {
+    Default,
+    File,
+    Memory,
+};
+
+///
+/// What happens to a query that is submitted while the queue of a connection is full
+///
+enum class QueueFullPolicy {
+    /// Cancel the future of the new query right away
+    Fail,
+    /// Wait until the connection finished a query. Queries submitted from the database thread itself are never blocked.
+    Block,
+    /// Cancel the oldest query of QueryPriority::Background that did not start yet, or the new query if there is none
+    DropOldestBackground,
+};
+
 ///
 /// Options for connecting to a database
 ///
@@ -52,10 +105,300 @@ public:
     void setPassword(const QString &password);
     const std::optional<QString> &password() const;
 
+    /// Set the number of additional read-only connections.
+    /// Each of them lives on its own thread, and getResults / getResult are sent to the least busy one,
+    /// while all other queries stay on the single writing connection.
+    /// Queries on different connections are not ordered relative to each other,
+    /// so a read may not observe a write that has not finished yet.
+    /// This is most useful for SQLite databases in WAL mode. It has no effect on in-memory databases.
+    /// Defaults to zero, which runs all queries on one connection.
+    void setReadConnectionCount(int count);
+    int readConnectionCount() const;
+
+    /// Set the maximum number of prepared queries that are kept per connection, including those of Query handles.
+    /// When the limit is reached, the least recently used query is dropped.
+    /// Zero disables caching prepared queries. Defaults to 256.
+    void setPreparedQueryCacheSize(std::size_t size);
+    std::size_t preparedQueryCacheSize() const;
+
+    /// Set the maximum number of rows that ThreadedDatabase::getCachedResults keeps, summed up over all cached results.
+    /// When the limit is reached, the least recently used result is dropped.
+    /// Zero disables the result cache, which is the default.
+    /// While the writing connection has queries queued or grouped writes uncommitted, the cache is bypassed.
+    /// With read connections, the cache is only used in SqliteJournalMode::Wal.
+    /// PRAGMA wal_autocheckpoint still sets the checkpoint interval, but its result is not returned while the cache is used.
+    void setResultCacheSize(std::size_t rows);
+    std::size_t resultCacheSize() const;
+
+    /// Enable group commit: Writes from execute are collected into one transaction,
+    /// which is committed after the given time window, or once the maximum number of statements is reached.
+    /// Each statement runs in its own savepoint, so a failing statement doesn't affect the others.
+    /// The futures of the writes finish once the transaction was committed.
+    /// If committing fails, all writes of the group are rolled back, and their futures are canceled.
+    ///
+    /// With a window of zero, the transaction is committed as soon as no more writes are waiting.
+    /// Statements that control transactions, such as BEGIN, as well as PRAGMAs, are not grouped.
+    /// Use ThreadedDatabase::transaction instead of sending BEGIN and COMMIT yourself.
+    void setGroupCommitWindow(std::chrono::milliseconds window);
+    const std::optional<std::chrono::milliseconds> &groupCommitWindow() const;
+
+    /// Set the maximum number of statements in one group commit. Defaults to 1000.
+    void setGroupCommitMaxStatements(std::size_t count);
+    std::size_t groupCommitMaxStatements() const;
+
+    /// Set the maximum number of queries per connection that are queued or running at the same time.
+    /// Zero allows any number of queries, which is the default.
+    void setMaxQueuedJobs(std::size_t count);
+    std::size_t maxQueuedJobs() const;
+
+    /// Set what happens once the maximum number of queued queries is reached. Defaults to QueueFullPolicy::Block.
+    /// The variants of execute and getResults with a callback call the callback with an empty result for rejected queries.
+    void setQueueFullPolicy(QueueFullPolicy policy);
+    QueueFullPolicy queueFullPolicy() const;
+
+    /// Run the connections on the threads of a pool, which they share with the connections of other databases,
+    /// instead of on threads of their own. Queries of connections on the same thread wait for each other.
+    void setThreadPool(std::shared_ptr<DatabaseThreadPool> pool);
+    const std::shared_ptr<DatabaseThreadPool> &threadPool() const;
+
+    /// Measure how long each phase of running a query takes, and aggregate the timings per query,
+    /// so they can be read through ThreadedDatabase::statistics(). Disabled by default.
+    void setCollectStatistics(bool collect);
+    bool collectStatistics() const;
+
+    /// Set a function that receives the timings of every query after it finished.
+    /// It is called on the thread of the connection that ran the query, so it must be thread-safe and return quickly.
+    void setQueryObserver(std::function<void (const QueryTiming &)> observer);
+    const std::function<void (const QueryTiming &)> &queryObserver() const;
+
+    /// Log queries that take longer than the threshold to execute and fetch their rows,
+    /// and keep the most recent of them for ThreadedDatabase::slowQueries().
+    /// On SQLite databases, the query plan is logged as well the first time a query is slow.
+    void setSlowQueryThreshold(std::chrono::milliseconds threshold);
+    const std::optional<std::chrono::milliseconds> &slowQueryThreshold() const;
+
+    /// Set the number of slow queries that are kept per connection. Defaults to 100.
+    void setSlowQueryLogSize(std::size_t size);
+    std::size_t slowQueryLogSize() const;
+
+    /// Set driver specific connect options, see QSqlDatabase::setConnectOptions
+    void setConnectOptions(const QString &options);
+    const std::optional<QString> &connectOptions() const;
+
+    /// Set SQL statements that run on every connection after it was opened, before any other query
+    void setInitStatements(const QStringList &statements);
+    const QStringList &initStatements() const;
+
+    /// The following settings only apply to SQLite databases. They are applied on each connection after it was opened,
+    /// before the init statements and any other query. Unset values keep the default of SQLite.
+
+    /// Set the journal mode. It is stored in the database file, so it is only set by the writing connection.
+    void setJournalMode(SqliteJournalMode mode);
+    const std::optional<SqliteJournalMode> &journalMode() const;
+
+    void setSynchronous(SqliteSynchronous synchronous);
+    const std::optional<SqliteSynchronous> &synchronous() const;
+
+    /// Set the maximum number of bytes of the database file that are memory-mapped
+    void setMmapSize(qint64 bytes);
+    const std::optional<qint64> &mmapSize() const;
+
+    /// Set the size of the page cache of each connection. Positive values are a number of pages, negative values a number of KiB.
+    void setCacheSize(qint64 size);
+    const std::optional<qint64> &cacheSize() const;
+
+    void setTempStore(SqliteTempStore tempStore);
+    const std::optional<SqliteTempStore> &tempStore() const;
+
+    /// Set how long to wait for a lock held by another connection, before a query fails
+    void setBusyTimeout(std::chrono::milliseconds timeout);
+    const std::optional<std::chrono::milliseconds> &busyTimeout() const;
+
 private:
     QSharedDataPointer<DatabaseConfigurationPrivate> d;
 };
 
+///
+/// Counters of the prepared query cache, summed up over all connections
+///
+struct PreparedQueryCacheStatistics {
+    /// Number of queries that were found in the cache
+    quint64 hits = 0;
+    /// Number of queries that had to be prepared
+    quint64 misses = 0;
+    /// Number of queries that were dropped from the cache to make space for new ones
+    quint64 evictions = 0;
+    /// Number of queries currently in the cache
+    std::size_t size = 0;
+};
+
+///
+/// Counters of the result cache of ThreadedDatabase::getCachedResults
+///
+struct ResultCacheStatistics {
+    /// Number of results that were found in the cache
+    quint64 hits = 0;
+    /// Number of results that had to be queried
+    quint64 misses = 0;
+    /// Number of results that were dropped because a table they read from was written to
+    quint64 invalidations = 0;
+    /// Number of results that were dropped to make space for new ones
+    quint64 evictions = 0;
+    /// Number of results currently in the cache
+    std::size_t size = 0;
+    /// Number of rows of the results currently in the cache
+    std::size_t rows = 0;
+};
+
+///
+/// Priority of a query. Queries of higher priority run first, unless a query of lower priority already waited for too long.
+///
+using QueryPriority = asyncdatabase_private::QueryPriority;
+
+///
+/// Time that jobs spent waiting for the database thread
+///
+struct QueueStatistics {
+    struct Lane {
+        /// Number of jobs that were started
+        quint64 jobs = 0;
+        /// Sum of the time the jobs waited
+        std::chrono::microseconds totalWait {};
+        /// Longest time a job waited
+        std::chrono::microseconds maxWait {};
+    };
+
+    /// Indexed by QueryPriority
+    std::array<Lane, 3> lanes;
+
+    /// Number of queries that are queued or running right now, summed up over all connections
+    std::size_t depth = 0;
+    /// Highest depth any single connection reached so far
+    std::size_t highWaterMark = 0;
+    /// Queries that were rejected because the queue was full
+    quint64 rejected = 0;
+    /// Queued queries that were dropped for new ones, see QueueFullPolicy::DropOldestBackground
+    quint64 dropped = 0;
+
+    const Lane &lane(QueryPriority priority) const {
+        return lanes[size_t(priority)];
+    }
+};
+
+///
+/// Distribution of durations, in buckets of powers of two microseconds
+///
+struct FUTURESQL_EXPORT LatencyHistogram {
+    /// Bucket i counts the durations from 2^(i-1) up to 2^i microseconds.
+    /// The first bucket counts durations below one microsecond, the last one all durations that don't fit into the others.
+    std::array<quint64, 32> buckets {};
+    /// Number of durations
+    quint64 count = 0;
+    /// Sum of the durations
+    std::chrono::nanoseconds total {};
+    /// Longest duration
+    std::chrono::nanoseconds max {};
+
+    void add(std::chrono::nanoseconds duration);
+    void merge(const LatencyHistogram &other);
+
+    /// Upper bound of the bucket that contains the given fraction of the durations, for example 0.99 for the 99th percentile
+    std::chrono::microseconds percentile(double fraction) const;
+};
+
+///
+/// Time spent in each phase of running one query
+///
+struct QueryTiming {
+    /// SQL query as it was submitted
+    QString sql;
+    /// Time the job waited for the database thread. Only set for the first query of a job.
+    std::chrono::nanoseconds queueWait {};
+    /// Time until the query started to execute, including looking it up in the prepared query cache and binding the values
+    std::chrono::nanoseconds prepare {};
+    bool preparedQueryCacheHit = false;
+    /// Time the database took to execute the query
+    std::chrono::nanoseconds execution {};
+    /// Time spent stepping to the next row
+    std::chrono::nanoseconds fetch {};
+    /// Time spent converting the rows into the result type
+    std::chrono::nanoseconds deserialization {};
+    /// Number of rows that were fetched
+    quint64 rows = 0;
+    bool succeeded = false;
+
+    std::chrono::nanoseconds total() const {
+        return queueWait + prepare + execution + fetch + deserialization;
+    }
+};
+
+///
+/// Timings of all runs of a query, summed up over all connections
+///
+struct QueryStatistics {
+    /// SQL query with literal values replaced by placeholders, so queries that only differ in their values are counted together
+    QString sql;
+    /// Number of runs
+    quint64 count = 0;
+    quint64 failures = 0;
+    quint64 preparedQueryCacheHits = 0;
+    quint64 rows = 0;
+
+    LatencyHistogram queueWait;
+    LatencyHistogram prepare;
+    LatencyHistogram execution;
+    LatencyHistogram fetch;
+    LatencyHistogram deserialization;
+    LatencyHistogram total;
+};
+
+///
+/// A query that took longer than the slow query threshold
+///
+struct SlowQuery {
+    /// SQL query as it was submitted
+    QString sql;
+    /// Types of the values that were bound to the placeholders
+    QStringList parameterTypes;
+    /// Number of rows that were fetched
+    quint64 rows = 0;
+    /// Time spent executing the query and fetching its rows
+    std::chrono::nanoseconds duration {};
+    /// When the query finished
+    std::chrono::system_clock::time_point time;
+    /// Output of EXPLAIN QUERY PLAN, only for the first slow run of each query on SQLite databases
+    QString queryPlan;
+};
+
+///
+/// Format of the files that ThreadedDatabase::importFrom reads and ThreadedDatabase::exportTo writes
+///
+enum class FileFormat {
+    /// Comma separated values as described in RFC 4180. NULL is written as an empty field, and an empty string as "".
+    /// Blobs are written as \x followed by their bytes in hex, and text starting with \x is quoted.
+    /// When importing, only unquoted fields starting with \x are read as blobs.
+    Csv,
+    /// Tab separated values. Tabs, line breaks and backslashes in values are escaped with a backslash, and NULL is written as \N.
+    /// Blobs are written as \x followed by their bytes in hex. As backslashes in text are escaped, text can't be confused with them.
+    Tsv,
+    /// The column names and values serialized with QDataStream, which keeps the types of the values, including blobs.
+    Binary,
+};
+
+///
+/// Options for ThreadedDatabase::importFrom
+///
+struct ImportOptions {
+    FileFormat format = FileFormat::Csv;
+    /// Whether the first record of a CSV or TSV file contains the names of the columns to insert into.
+    /// Otherwise the values fill the columns of the table in order. Binary files always contain the column names.
+    bool header = true;
+    /// Number of rows that are inserted with one batch query
+    std::size_t batchSize = 1000;
+    /// Number of rows after which the transaction is committed and a new one is started, so the journal doesn't grow without bounds
+    std::size_t commitInterval = 100000;
+};
+
 ///
 /// The SQLite database driver
 ///
@@ -71,10 +414,267 @@ concept FromSql = requires(T v, typename T::ColumnTypes row)
 template <typename ...Args>
 constexpr bool isQVariantConvertible = std::conjunction_v<std::is_convertible<Args, QVariant>...>;
 
+///
+/// A query that is known at compile time, for example `Query<"SELECT * FROM test WHERE id = ?">`.
+///
+/// It can be passed instead of a query string to avoid looking up the prepared query by its text,
+/// and the number of arguments is checked against the number of positional placeholders at compile time.
+///
+template <asyncdatabase_private::FixedString Sql>
+struct Query {
+    /// Number of positional placeholders, or -1 if the query uses named or numbered placeholders
+    static constexpr int placeholderCount = asyncdatabase_private::countPlaceholders(Sql);
+
+    static constexpr bool acceptsArgumentCount(std::size_t count) {
+        return placeholderCount < 0 || std::size_t(placeholderCount) == count;
+    }
+
+    static const QString &sql() {
+        static const QString sql = QString::fromUtf8(Sql.data, sizeof(Sql.data) - 1);
+        return sql;
+    }
+
+    static std::size_t id() {
+        static const std::size_t id = asyncdatabase_private::registerQuery();
+        return id;
+    }
+};
+
+///
+/// Synchronous access to the database inside of a ThreadedDatabase::transaction
+///
+using Transaction = asyncdatabase_private::Transaction;
+
+///
+/// Builds a chain of queries that run back to back on the database thread, inside of one transaction.
+///
+/// Later steps can use results of earlier steps as parameters, by passing lastInsertId(), insertId() or column()
+/// instead of a value. For example:
+/// ```
+/// database->pipeline()
+///     .execute("INSERT INTO playlists (name) VALUES (?)", name)
+///     .execute("INSERT INTO entries (playlist, track) VALUES (?, ?)", Pipeline::lastInsertId(), track)
+///     .getResults<Entry>("SELECT * FROM entries WHERE playlist = ?", Pipeline::insertId(0));
+/// ```
+/// If a step fails, or refers to a step that did not run or did not produce the value, for example a fetchRow step
+/// that found no row, the transaction is rolled back and the future returns an empty result.
+///
+class Pipeline {
+public:
+    using Value = asyncdatabase_private::PipelineValue;
+
+    /// The id of the row that was inserted by the last execute step
+    static Value lastInsertId() {
+        return Value { Value::Kind::LastInsertId };
+    }
+
+    /// The id of the row that was inserted by the execute step with the given index, counting from zero
+    static Value insertId(std::size_t step) {
+        return Value { Value::Kind::InsertId, step };
+    }
+
+    /// A column of the row that was fetched by the fetchRow step with the given index, counting from zero
+    static Value column(std::size_t step, int column) {
+        return Value { Value::Kind::Column, step, column };
+    }
+
+    /// Add a step that executes a query, ignoring its result
+    template <asyncdatabase_private::PipelineArgument ...Args>
+    Pipeline &execute(const QString &sqlQuery, Args... args) {
+        m_steps.push_back(asyncdatabase_private::makePipelineStep(asyncdatabase_private::PipelineStep::Kind::Execute, sqlQuery, std::move(args)...));
+        return *this;
+    }
+
+    /// Add a step that fetches the first row of the result of a query, so later steps can refer to its columns
+    template <asyncdatabase_private::PipelineArgument ...Args>
+    Pipeline &fetchRow(const QString &sqlQuery, Args... args) {
+        m_steps.push_back(asyncdatabase_private::makePipelineStep(asyncdatabase_private::PipelineStep::Kind::FetchRow, sqlQuery, std::move(args)...));
+        return *this;
+    }
+
+    /// Run the steps. The future tells whether the transaction was committed.
+    QFuture<bool> commit() {
+        return m_db.pipelineCommit(std::move(m_steps));
+    }
+
+    /// Run the steps, then a last query whose result is returned like from ThreadedDatabase::getResults
+    template <typename T, asyncdatabase_private::PipelineArgument ...Args>
+    requires FromSql<T>
+    QFuture<std::vector<T>> getResults(const QString &sqlQuery, Args... args) {
+        auto last = asyncdatabase_private::makePipelineStep(asyncdatabase_private::PipelineStep::Kind::FetchRow, sqlQuery, std::move(args)...);
+        return m_db.pipelineResults<T>(std::move(m_steps), std::move(last));
+    }
+
+    /// Run the steps, then a last query whose result is returned like from ThreadedDatabase::getResult
+    template <typename T, asyncdatabase_private::PipelineArgument ...Args>
+    requires FromSql<T>
+    QFuture<std::optional<T>> getResult(const QString &sqlQuery, Args... args) {
+        auto last = asyncdatabase_private::makePipelineStep(asyncdatabase_private::PipelineStep::Kind::FetchRow, sqlQuery, std::move(args)...);
+        return m_db.pipelineResult<T>(std::move(m_steps), std::move(last));
+    }
+
+private:
+    friend class ThreadedDatabase;
+
+    explicit Pipeline(asyncdatabase_private::AsyncSqlDatabase &db)
+        : m_db(db)
+    {
+    }
+
+    asyncdatabase_private::AsyncSqlDatabase &m_db;
+    std::vector<asyncdatabase_private::PipelineStep> m_steps;
+};
+
+///
+/// Base of LiveQuery, which provides its signal
+///
+class FUTURESQL_EXPORT LiveQueryBase : public QObject {
+    Q_OBJECT
+
+public:
+    ~LiveQueryBase() override;
+
+    ///
+    /// \brief Set how long to wait after a write before running the query again, so a burst of writes causes only one query.
+    ///
+    /// Defaults to 50 milliseconds.
+    ///
+    void setDebounceInterval(std::chrono::milliseconds interval);
+
+Q_SIGNALS:
+    ///
+    /// \brief Emitted once the first results are available, and whenever they changed after that.
+    ///
+    void resultsChanged();
+
+protected:
+    explicit LiveQueryBase(asyncdatabase_private::AsyncSqlDatabase &writer);
+
+    // Starts watching the tables that the query reads from, and then runs it
+    void watch(const QString &sqlQuery);
+    // Runs the query, and calls finishRefresh with the results on the thread of this object,
+    // or refreshRejected if the queue of the connection was full
+    virtual void refresh() = 0;
+    void finishRefresh(bool changed);
+    void refreshRejected();
+    // Stops watching the tables and running the query. Called by the destructor of LiveQuery,
+    // so nothing runs the query anymore while the results are destroyed.
+    void stopWatching();
+
+private:
+    void tablesChanged();
+    void runQuery();
+
+    asyncdatabase_private::AsyncSqlDatabase &m_writer;
+    std::optional<quint64> m_watchId;
+    QTimer *m_timer;
+    bool m_started = false;
+    bool m_running = false;
+    // Tables changed while the query was running
+    bool m_outdated = false;
+};
+
+///
+/// Results of a query that are kept up to date, see ThreadedDatabase::watch.
+///
+template <typename T>
+class LiveQuery : public LiveQueryBase {
+public:
+    ///
+    /// \brief The most recent results, empty until resultsChanged was first emitted.
+    ///
+    const std::vector<T> &results() const {
+        return m_results;
+    }
+
+private:
+    friend class ThreadedDatabase;
+
+    // Runs the query and passes the results to the callback on the thread of the context, or calls rejected there
+    using Run = std::function<void (QObject *context, std::function<void (std::vector<T> &&)> callback, std::function<void ()> rejected)>;
+
+    LiveQuery(asyncdatabase_private::AsyncSqlDatabase &writer, Run run)
+        : LiveQueryBase(writer)
+        , m_run(std::move(run))
+    {
+    }
+
+    ~LiveQuery() override {
+        stopWatching();
+    }
+
+    void refresh() override {
+        m_run(this, [this](std::vector<T> &&rows) {
+            bool changed = !m_hasResults;
+            if constexpr (std::equality_comparable<T>) {
+                changed = changed || rows != m_results;
+            } else {
+                changed = true;
+            }
+
+            m_results = std::move(rows);
+            m_hasResults = true;
+            finishRefresh(changed);
+        }, [this] {
+            refreshRejected();
+        });
+    }
+
+    Run m_run;
+    std::vector<T> m_results;
+    bool m_hasResults = false;
+};
+
 struct ThreadedDatabasePrivate;
+struct DatabaseThreadPoolPrivate;
+
+///
+/// A fixed number of threads that the connections of many databases share, see DatabaseConfiguration::setThreadPool.
+///
+/// Each connection stays on the thread it was assigned to, which is the thread with the fewest connections at that time.
+/// Of threads with as many connections, the one whose connections have the fewest queued jobs is chosen.
+/// The pool is kept alive by the databases that use it. If the last of them is destroyed on a thread of the pool,
+/// that thread is not waited for, and deletes itself once it finished.
+///
+/// Destroying a database waits for each of its connections to close on its thread.
+/// On a thread of the pool, only destroy databases whose connections all live on that thread,
+/// as two pool threads waiting for each other would deadlock.
+///
+class FUTURESQL_EXPORT DatabaseThreadPool {
+public:
+    ///
+    /// \brief Start the threads of the pool
+    /// \param threadCount number of threads, by default one per processor core
+    ///
+    explicit DatabaseThreadPool(int threadCount = QThread::idealThreadCount());
+    ~DatabaseThreadPool();
+
+    ///
+    /// \brief Number of threads in the pool
+    ///
+    int threadCount() const;
 
+    ///
+    /// \brief Number of connections on each thread
+    ///
+    std::vector<int> connectionCounts() const;
+
+private:
+    friend struct ThreadedDatabasePrivate;
+
+    QThread *acquireThread(asyncdatabase_private::AsyncSqlDatabase *connection);
+    void releaseThread(asyncdatabase_private::AsyncSqlDatabase *connection);
+    bool hasThread(const QThread *thread) const;
+
+    std::unique_ptr<DatabaseThreadPoolPrivate> d;
+};
+
+///
+/// A database connection that lives on a new thread, or on a thread of a DatabaseThreadPool
 ///
-/// A database connection that lives on a new thread
+/// Canceling a future returned by one of its functions skips the query if it didn't start yet.
+/// Running queries stop fetching rows, and on SQLite databases, the statement is interrupted as well.
+/// The result of a canceled future must not be accessed.
 ///
 class FUTURESQL_EXPORT ThreadedDatabase : public QThread {
 public:
@@ -94,9 +694,61 @@ public:
     template <typename ...Args>
     requires isQVariantConvertible<Args...>
     auto execute(const QString &sqlQuery, Args... args) -> QFuture<void> {
-        return db().execute(sqlQuery, args...);
+        return db().execute(sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like execute, but for a query that is known at compile time.
+    ///
+    template <asyncdatabase_private::FixedString Sql, typename ...Args>
+    requires isQVariantConvertible<Args...>
+    auto execute(Query<Sql> query, Args... args) -> QFuture<void> {
+        static_assert(Query<Sql>::acceptsArgumentCount(sizeof...(Args)), "The number of arguments does not match the placeholders in the query");
+        return db().execute(query, std::move(args)...);
+    }
+
+    ///
+    /// \brief Execute an SQL query once for every row of parameters, in a single transaction.
+    /// \param SQL query string to execute
+    /// \param Rows of parameters. Each tuple is bound to the placeholders of the query for one execution.
+    ///        The values are moved into the query, so pass the rows with std::move if they are not needed anymore.
+    /// \return a future that finishes when all rows were processed
+    ///
+    /// This is much faster than calling execute for each row, as the query is only prepared once,
+    /// and only one transaction needs to be committed.
+    /// If one of the rows fails, the whole batch is rolled back.
+    ///
+    template <typename ...Args>
+    requires isQVariantConvertible<Args...>
+    auto executeBatch(const QString &sqlQuery, std::vector<std::tuple<Args...>> rows) -> QFuture<void> {
+        return db().executeBatch(sqlQuery, std::move(rows));
     }
 
+    ///
+    /// \brief Run a function inside of a transaction on the database thread.
+    /// \param Function that receives a `Transaction &`, through which it can run queries synchronously.
+    /// \return a future of whether the transaction was committed if the function returns void,
+    ///         otherwise a future of the return value of the function, which is empty if the transaction was rolled back.
+    ///
+    /// The transaction is rolled back if any of its queries fails, if the function calls Transaction::rollback(),
+    /// if the function throws an exception, or if the future is canceled before the function returned.
+    /// No other queries on this database can run while the function is running.
+    ///
+    /// The function is queued like a query, which needs it to be copyable. Move-only callables are not supported.
+    ///
+    template <typename Func>
+    requires std::invocable<Func, Transaction &> && std::copy_constructible<Func>
+    auto transaction(Func func) -> QFuture<asyncdatabase_private::TransactionResult<std::invoke_result_t<Func, Transaction &>>> {
+        return db().transaction(std::move(func));
+    }
+
+    ///
+    /// \brief Start building a pipeline of queries that depend on each other, see Pipeline.
+    ///
+    /// The pipeline refers to this database, so it must not outlive it.
+    ///
+    Pipeline pipeline();
+
     ///
     /// Run database migrations in the given directory.
     /// The directory needs to contain a subdirectory for each migration.
@@ -108,6 +760,13 @@ public:
     ///
     auto runMigrations(const QString &migrationDirectory) -> QFuture<void>;
 
+    ///
+    /// \brief Like runMigrations, but calls a function once the migrations finished, instead of returning a future.
+    ///
+    /// See the variant of execute with a callback for the details.
+    ///
+    void runMigrations(QObject *context, std::function<void ()> callback, const QString &migrationDirectory);
+
     ///
     /// Declare that the database is currently at the state of the migration in the migration subdirectory
     /// migrationName.
@@ -130,10 +789,214 @@ public:
     /// and a, if the column types are not the same types in the same order as the attributes of the struct,
     /// a `static T fromSql(ColumnTypes tuple)` deserialization method.
     ///
+    /// The rows are moved into the future without being copied when building against Qt 6,
+    /// which also allows move-only types for T.
+    ///
     template <typename T, typename ...Args>
     requires FromSql<T> && isQVariantConvertible<Args...>
     auto getResults(const QString &sqlQuery, Args... args) -> QFuture<std::vector<T>> {
-        return db().getResults<T, Args...>(sqlQuery, args...);
+        return readDb().getResults<T>(sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like getResults, but for a query that is known at compile time.
+    ///
+    template <typename T, asyncdatabase_private::FixedString Sql, typename ...Args>
+    requires FromSql<T> && isQVariantConvertible<Args...>
+    auto getResults(Query<Sql> query, Args... args) -> QFuture<std::vector<T>> {
+        static_assert(Query<Sql>::acceptsArgumentCount(sizeof...(Args)), "The number of arguments does not match the placeholders in the query");
+        return readDb().getResults<T>(query, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like getResults, but keeps the result in the cache set up by DatabaseConfiguration::setResultCacheSize.
+    ///
+    /// Later calls with the same query, parameters and result type return the cached rows without running the query,
+    /// and without waiting for the database thread, until a table that the query reads from is written to.
+    /// This suits small tables that are read often and rarely change.
+    ///
+    /// Writes are noticed through the hooks of the SQLite connections of this database, so the cache is only used
+    /// on SQLite databases, when the driver uses the same SQLite library as this library.
+    /// Writes from other processes, to WITHOUT ROWID tables, and results of queries that use
+    /// time or random functions are not tracked, so such results are not cached or need clearResultCache.
+    ///
+    template <typename T, typename ...Args>
+    requires FromSql<T> && std::copy_constructible<T> && isQVariantConvertible<Args...>
+    auto getCachedResults(const QString &sqlQuery, Args... args) -> QFuture<std::vector<T>> {
+        // A cached result doesn't reflect writes that are still queued
+        if (db().hasPendingWrites()) {
+            return readDb().getResults<T>(sqlQuery, std::move(args)...);
+        }
+        return readDb().getCachedResults<T>(sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like getCachedResults, but for a query that is known at compile time.
+    ///
+    template <typename T, asyncdatabase_private::FixedString Sql, typename ...Args>
+    requires FromSql<T> && std::copy_constructible<T> && isQVariantConvertible<Args...>
+    auto getCachedResults(Query<Sql> query, Args... args) -> QFuture<std::vector<T>> {
+        static_assert(Query<Sql>::acceptsArgumentCount(sizeof...(Args)), "The number of arguments does not match the placeholders in the query");
+        if (db().hasPendingWrites()) {
+            return readDb().getResults<T>(query, std::move(args)...);
+        }
+        return readDb().getCachedResults<T>(query, std::move(args)...);
+    }
+
+    ///
+    /// \brief Run a query now and again whenever a table it reads from was written to.
+    /// \param SQL Query to execute
+    /// \param parameters to bind to the placeholders in the SQL query.
+    /// \return an object that emits LiveQuery::resultsChanged when new results are available.
+    ///        It lives on the current thread, and must be destroyed before this database.
+    ///
+    /// The query runs again after writes on this database were committed, instead of polling it on a timer.
+    /// Writes shortly after one another cause only one query, see LiveQuery::setDebounceInterval.
+    /// If T can be compared, resultsChanged is only emitted if the results are different.
+    ///
+    /// Writes are noticed through the hooks of the SQLite connection like for getCachedResults,
+    /// so on other databases the query only runs once.
+    ///
+    template <typename T, typename ...Args>
+    requires FromSql<T> && isQVariantConvertible<Args...>
+    auto watch(const QString &sqlQuery, Args... args) -> std::unique_ptr<LiveQuery<T>> {
+        auto &reader = readDb();
+        std::unique_ptr<LiveQuery<T>> liveQuery(new LiveQuery<T>(db(), [&reader, sqlQuery, ...args = std::move(args)](QObject *context, auto callback, auto rejected) {
+            reader.runWithCallback(context, reader.template resultsJob<T>(sqlQuery, args...), std::move(callback), std::move(rejected));
+        }));
+        liveQuery->watch(sqlQuery);
+        return liveQuery;
+    }
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    ///
+    /// \brief Like getResults, but allocates the vector of results from the given memory resource.
+    ///
+    /// The resource is used on the database thread while the rows are fetched, and later wherever the vector is used,
+    /// so it must either be thread-safe, like std::pmr::synchronized_pool_resource,
+    /// or not be used by other threads until the future finished.
+    /// A std::pmr::monotonic_buffer_resource works as an arena for the rows, which the caller releases at once.
+    ///
+    /// Take the rows out of the future with QFuture::takeResult, since QFuture::result copies them
+    /// into a vector that uses the default memory resource.
+    /// Only available with Qt 6, as Qt 5 always copies the result into the future.
+    ///
+    template <typename T, typename ...Args>
+    requires FromSql<T> && isQVariantConvertible<Args...>
+    auto getResults(std::pmr::memory_resource *resource, const QString &sqlQuery, Args... args) -> QFuture<std::pmr::vector<T>> {
+        return readDb().getResults<T>(resource, sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like getResults with a memory resource, but for a query that is known at compile time.
+    ///
+    template <typename T, asyncdatabase_private::FixedString Sql, typename ...Args>
+    requires FromSql<T> && isQVariantConvertible<Args...>
+    auto getResults(std::pmr::memory_resource *resource, Query<Sql> query, Args... args) -> QFuture<std::pmr::vector<T>> {
+        static_assert(Query<Sql>::acceptsArgumentCount(sizeof...(Args)), "The number of arguments does not match the placeholders in the query");
+        return readDb().getResults<T>(resource, query, std::move(args)...);
+    }
+#endif
+
+    ///
+    /// \brief Like getResults, but hands out the rows in chunks while they are fetched from the database.
+    /// \param SQL Query to execute
+    /// \param maximum number of rows per chunk, must be at least 1.
+    ///        Room for at most 1024 rows is reserved up front, larger chunks grow while they are filled.
+    /// \param function that receives each chunk of rows. It is called on the database thread,
+    ///        so it should hand the rows off quickly and must not block on the database.
+    /// \param parameters to bind to the placeholders in the SQL query.
+    /// \return a future that finishes after the last chunk was handed out.
+    ///
+    /// Only one chunk of rows is held in memory at a time, which makes this suitable for large result sets.
+    ///
+    template <typename T, typename ...Args>
+    requires FromSql<T> && isQVariantConvertible<Args...>
+    auto streamResults(const QString &sqlQuery, std::size_t chunkSize, std::function<void (std::vector<T> &&)> consumer, Args... args) -> QFuture<void> {
+        return readDb().streamResults<T>(sqlQuery, chunkSize, std::move(consumer), std::move(args)...);
+    }
+
+    ///
+    /// \brief Like streamResults, but for a query that is known at compile time.
+    ///
+    template <typename T, asyncdatabase_private::FixedString Sql, typename ...Args>
+    requires FromSql<T> && isQVariantConvertible<Args...>
+    auto streamResults(Query<Sql> query, std::size_t chunkSize, std::function<void (std::vector<T> &&)> consumer, Args... args) -> QFuture<void> {
+        static_assert(Query<Sql>::acceptsArgumentCount(sizeof...(Args)), "The number of arguments does not match the placeholders in the query");
+        return readDb().streamResults<T>(query, chunkSize, std::move(consumer), std::move(args)...);
+    }
+
+    ///
+    /// \brief Write the result of a query to a file, without holding more than one row in memory.
+    /// \param device to write to. It must be open for writing, and is used on the database thread,
+    ///        so it must not be used elsewhere until the future finished.
+    /// \param format of the file. CSV and TSV files start with a record of the column names.
+    /// \param SQL Query to execute
+    /// \param parameters to bind to the placeholders in the SQL query.
+    /// \return Future of the number of rows that were written, or 0 if writing failed.
+    ///         The progress value of the future is the number of rows written so far.
+    ///         If the driver knows the size of the result, it is also set as the progress range.
+    ///         Otherwise, like for SQLite, the range stays empty and only the running count is reported.
+    ///
+    template <typename ...Args>
+    requires isQVariantConvertible<Args...>
+    auto exportTo(QIODevice *device, FileFormat format, const QString &sqlQuery, Args... args) -> QFuture<quint64> {
+        return readDb().exportTo(device, format, sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like exportTo with a device, but replaces the file at the given path.
+    ///
+    template <typename ...Args>
+    requires isQVariantConvertible<Args...>
+    auto exportTo(const QString &filePath, FileFormat format, const QString &sqlQuery, Args... args) -> QFuture<quint64> {
+        return readDb().exportTo(filePath, format, sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Insert the records of a file into a table, for example one written by exportTo.
+    /// \param device to read from. It must be open for reading, and is used on the database thread,
+    ///        so it must not be used elsewhere until the future finished.
+    /// \param name of the table
+    /// \param options like the format of the file
+    /// \return Future of the number of rows that were committed.
+    ///
+    /// The records are read and inserted in batches, so memory usage doesn't depend on the size of the file.
+    /// If a record can't be read or inserted, or the future is canceled, the rows since the last commit are rolled back.
+    /// The progress of the future is the percentage of the file that was read, or the number of rows if the size of the device is unknown.
+    ///
+    /// Other queries wait until the import finished.
+    ///
+    QFuture<quint64> importFrom(QIODevice *device, const QString &table, const ImportOptions &options = {});
+
+    ///
+    /// \brief Like importFrom with a device, but reads the file at the given path.
+    ///
+    QFuture<quint64> importFrom(const QString &filePath, const QString &table, const ImportOptions &options = {});
+
+    ///
+    /// \brief Execute an SQL query on the database, and retrieve the result as one vector per column.
+    /// \param SQL Query to execute
+    /// \param parameters to bind to the placeholders in the SQL query.
+    /// \return Future of a tuple that contains a vector of values of type Ts[i] for the i-th column.
+    ///
+    /// The values of each column are stored contiguously, which suits processing many rows column by column,
+    /// for example for aggregations.
+    ///
+    template <typename ...Ts, typename ...Args>
+    requires (sizeof...(Ts) > 0) && isQVariantConvertible<Args...>
+    auto getColumns(const QString &sqlQuery, Args... args) -> QFuture<std::tuple<std::vector<Ts>...>> {
+        return readDb().getColumns<Ts...>(sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like getColumns, but for a query that is known at compile time.
+    ///
+    template <typename ...Ts, asyncdatabase_private::FixedString Sql, typename ...Args>
+    requires (sizeof...(Ts) > 0) && isQVariantConvertible<Args...>
+    auto getColumns(Query<Sql> query, Args... args) -> QFuture<std::tuple<std::vector<Ts>...>> {
+        static_assert(Query<Sql>::acceptsArgumentCount(sizeof...(Args)), "The number of arguments does not match the placeholders in the query");
+        return readDb().getColumns<Ts...>(query, std::move(args)...);
     }
 
     ///
@@ -142,14 +1005,131 @@ public:
     template <typename T, typename ...Args>
     requires FromSql<T> && isQVariantConvertible<Args...>
     auto getResult(const QString &sqlQuery, Args... args) -> QFuture<std::optional<T>> {
-        return db().getResult<T, Args...>(sqlQuery, args...);
+        return readDb().getResult<T>(sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like getResult, but for a query that is known at compile time.
+    ///
+    template <typename T, asyncdatabase_private::FixedString Sql, typename ...Args>
+    requires FromSql<T> && isQVariantConvertible<Args...>
+    auto getResult(Query<Sql> query, Args... args) -> QFuture<std::optional<T>> {
+        static_assert(Query<Sql>::acceptsArgumentCount(sizeof...(Args)), "The number of arguments does not match the placeholders in the query");
+        return readDb().getResult<T>(query, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like execute, but calls a function once the query finished, instead of returning a future.
+    /// \param context object on whose thread the callback is called. If it is destroyed before the query started, the query is skipped.
+    ///        If it is nullptr, the callback is called directly on the database thread, so it must return quickly.
+    /// \param function without arguments
+    /// \param SQL query string to execute
+    /// \param Parameters to bind to the placeholders in the SQL Query
+    ///
+    /// Compared to a future, this saves creating the shared state of the future, and the event that a QFutureWatcher needs.
+    /// That matters when sending many small queries.
+    ///
+    /// The context must be alive when the query is submitted. If it is destroyed later, the callback is not called.
+    /// The callback must be copyable, move-only callables are not supported.
+    ///
+    /// If the queue is full, see DatabaseConfiguration::setMaxQueuedJobs, the query is rejected, and the callback
+    /// is called with an empty result, like for a query that failed. Without a context, it is then called
+    /// on the thread that submitted the query which caused the rejection.
+    ///
+    template <typename Callback, typename ...Args>
+    requires std::invocable<Callback> && isQVariantConvertible<Args...>
+    void execute(QObject *context, Callback callback, const QString &sqlQuery, Args... args) {
+        db().executeWithCallback(context, std::move(callback), sqlQuery, std::move(args)...);
+    }
+
+    ///
+    /// \brief Like getResults, but passes the rows to a function on the thread of the context, instead of returning a future.
+    ///
+    /// See the variant of execute with a callback for the details.
+    ///
+    template <typename T, typename Callback, typename ...Args>
+    requires FromSql<T> && std::invocable<Callback, std::vector<T>> && isQVariantConvertible<Args...>
+    void getResults(QObject *context, Callback callback, const QString &sqlQuery, Args... args) {
+        auto &db = readDb();
+        db.runWithCallback(context, db.resultsJob<T>(sqlQuery, std::move(args)...), std::move(callback));
+    }
+
+    ///
+    /// \brief Like getResult, but passes the row to a function on the thread of the context, instead of returning a future.
+    ///
+    /// See the variant of execute with a callback for the details.
+    ///
+    template <typename T, typename Callback, typename ...Args>
+    requires FromSql<T> && std::invocable<Callback, std::optional<T>> && isQVariantConvertible<Args...>
+    void getResult(QObject *context, Callback callback, const QString &sqlQuery, Args... args) {
+        auto &db = readDb();
+        db.runWithCallback(context, db.resultJob<T>(sqlQuery, std::move(args)...), std::move(callback));
     }
 
+    ///
+    /// \brief Submit queries with a different priority than QueryPriority::Normal.
+    /// \param priority of the queries
+    /// \param function that submits queries, for example `[&] { return database->execute(...); }`.
+    ///        It must only submit queries, not wait for them.
+    /// \return the return value of the function
+    ///
+    /// The priority applies to all queries that are submitted from the current thread while the function runs.
+    /// Note that queries with different priorities may run in a different order than they were submitted.
+    ///
+    template <typename Func>
+    static auto withPriority(QueryPriority priority, Func func) -> std::invoke_result_t<Func> {
+        asyncdatabase_private::QueryPriorityScope scope(priority);
+        return func();
+    }
+
+    ///
+    /// \brief Statistics about the time that queries waited for the database thread, per priority
+    ///
+    QueueStatistics queueStatistics() const;
+
+    ///
+    /// \brief Statistics about the usage of the prepared query cache
+    ///
+    PreparedQueryCacheStatistics preparedQueryCacheStatistics() const;
+
+    ///
+    /// \brief Timings of the queries that ran so far, the query with the most total time first.
+    ///
+    /// Only available if DatabaseConfiguration::setCollectStatistics was enabled.
+    ///
+    std::vector<QueryStatistics> statistics() const;
+
+    ///
+    /// \brief The most recent queries that took longer than DatabaseConfiguration::setSlowQueryThreshold, oldest first.
+    ///
+    std::vector<SlowQuery> slowQueries() const;
+
+    ///
+    /// \brief Statistics about the usage of the result cache of getCachedResults
+    ///
+    ResultCacheStatistics resultCacheStatistics() const;
+
+    ///
+    /// \brief Drop all results cached by getCachedResults, for example after the database was changed from a different process.
+    ///
+    void clearResultCache();
+
+    ///
+    /// \brief Drop all cached prepared queries.
+    ///
+    /// This happens asynchronously, but before any query that is submitted afterwards,
+    /// since it is queued with QueryPriority::Interactive.
+    ///
+    void clearPreparedQueryCache();
+
     ThreadedDatabase();
     ~ThreadedDatabase();
 
 private:
+    friend class ShardedDatabase;
+
     asyncdatabase_private::AsyncSqlDatabase &db();
+    asyncdatabase_private::AsyncSqlDatabase &readDb();
 
     std::unique_ptr<ThreadedDatabasePrivate> d;
 };
@@ -4,12 +4,23 @@
 
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <functional>
 #include <memory>
+#include <memory_resource>
+#include <string>
 #include <tuple>
 #include <optional>
+#include <typeinfo>
+#include <unordered_set>
+#include <variant>
 
 #include <QFuture>
 #include <QFutureWatcher>
+#include <QPointer>
+#include <QSqlError>
 #include <QSqlQuery>
 #include <QSqlDatabase>
 #include <QThread>
@@ -17,9 +28,21 @@
 #include <futuresql_export.h>
 
 class DatabaseConfiguration;
+class QIODevice;
+enum class FileFormat;
+struct ImportOptions;
+struct PreparedQueryCacheStatistics;
+struct QueueStatistics;
+struct ResultCacheStatistics;
+struct QueryStatistics;
+struct QueryTiming;
+struct SlowQuery;
 
 namespace asyncdatabase_private {
 
+class Transaction;
+class ResultCache;
+
 // Helpers for iterating over tuples
 template <typename Tuple, typename Func, std::size_t i>
 inline constexpr void iterate_impl(Tuple &tup, Func fun)
@@ -41,7 +64,7 @@ inline constexpr void iterate_tuple(Tuple &tup, Func fun)
 // Helpers to construct a struct from a tuple
 template <typename T, typename ...Args>
 constexpr T constructFromTuple(std::tuple<Args...> &&args) {
-    return std::apply([](auto && ...args) { return T { args...}; }, std::move(args));
+    return std::apply([](auto && ...args) { return T { std::forward<decltype(args)>(args)... }; }, std::move(args));
 }
 
 template <typename T>
@@ -71,29 +94,185 @@ auto deserialize(typename T::ColumnTypes &&row) {
     return T::fromSql(std::move(row));
 }
 
-using Row  = std::vector<QVariant>;
-using Rows = std::vector<Row>;
+// Reads the columns of the current row of the query directly into the tuple
+template <typename RowTypesTuple, std::size_t ...I>
+auto parseRow(const QSqlQuery &query, std::index_sequence<I...>) -> RowTypesTuple
+{
+    return RowTypesTuple { query.value(I).value<std::tuple_element_t<I, RowTypesTuple>>()... };
+}
 
 template <typename RowTypesTuple>
-auto parseRow(const Row &row) -> RowTypesTuple
+auto parseRow(const QSqlQuery &query) -> RowTypesTuple
 {
-    auto tuple = RowTypesTuple();
-    int i = 0;
-    asyncdatabase_private::iterate_tuple(tuple, [&](auto &elem) {
-        elem = row.at(i).value<std::decay_t<decltype(elem)>>();
-        i++;
-    });
-    return tuple;
+    return parseRow<RowTypesTuple>(query, std::make_index_sequence<std::tuple_size_v<RowTypesTuple>>());
 }
 
-template <typename RowTypesTuple>
-auto parseRows(const Rows &rows) -> std::vector<RowTypesTuple> {
-    std::vector<RowTypesTuple> parsedRows;
-    parsedRows.reserve(rows.size());
-    std::ranges::transform(rows, std::back_inserter(parsedRows), parseRow<RowTypesTuple>);
-    return parsedRows;
+// Moves the values of a row to the end of their columns
+template <typename ...Ts, std::size_t ...I>
+void appendToColumns(std::tuple<std::vector<Ts>...> &columns, std::tuple<Ts...> &&row, std::index_sequence<I...>)
+{
+    (std::get<I>(columns).push_back(std::move(std::get<I>(row))), ...);
+}
+
+// String that can be used as a template parameter
+template <std::size_t N>
+struct FixedString {
+    constexpr FixedString(const char (&string)[N]) {
+        std::copy_n(string, N, data);
+    }
+
+    char data[N] {};
+};
+
+// Number of positional placeholders in a query, or -1 if it uses placeholders that can't be counted
+template <std::size_t N>
+constexpr int countPlaceholders(const FixedString<N> &sql)
+{
+    constexpr auto isIdentifierStart = [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    };
+
+    int count = 0;
+    char quote = 0;
+    bool lineComment = false;
+    bool blockComment = false;
+    // The last character is the null terminator
+    for (std::size_t i = 0; i + 1 < N; i++) {
+        const char c = sql.data[i];
+        const char next = sql.data[i + 1];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            }
+        } else if (lineComment) {
+            lineComment = c != '\n';
+        } else if (blockComment) {
+            if (c == '*' && next == '/') {
+                blockComment = false;
+                i++;
+            }
+        } else if (c == '-' && next == '-') {
+            lineComment = true;
+            i++;
+        } else if (c == '/' && next == '*') {
+            blockComment = true;
+            i++;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '?') {
+            // Numbered placeholders can be used multiple times
+            if (next >= '0' && next <= '9') {
+                return -1;
+            }
+            count++;
+        } else if ((c == ':' || c == '@' || c == '$') && isIdentifierStart(next)) {
+            // Named placeholder
+            return -1;
+        }
+    }
+    return count;
+}
+
+// Returns a new unique id for a query that is known at compile time
+std::size_t registerQuery();
+
+template <typename T>
+concept RegisteredQuery = requires {
+    { T::id() } -> std::same_as<std::size_t>;
+    { T::sql() } -> std::same_as<const QString &>;
+};
+
+inline const QString &sqlText(const QString &sqlQuery) {
+    return sqlQuery;
+}
+
+template <RegisteredQuery Query>
+const QString &sqlText(const Query &) {
+    return Query::sql();
+}
+
+enum class QueryPriority {
+    Interactive,
+    Normal,
+    Background,
+};
+
+// Priority of the queries that are submitted from the current thread
+QueryPriority currentQueryPriority();
+
+// Changes the priority of the queries submitted from the current thread while it exists
+class QueryPriorityScope {
+public:
+    explicit QueryPriorityScope(QueryPriority priority);
+    ~QueryPriorityScope();
+
+    QueryPriorityScope(const QueryPriorityScope &) = delete;
+    QueryPriorityScope &operator=(const QueryPriorityScope &) = delete;
+
+private:
+    QueryPriority m_previous;
+};
+
+// Value that is only known while a pipeline runs
+struct PipelineValue {
+    enum class Kind {
+        LastInsertId,
+        InsertId,
+        Column,
+    };
+
+    Kind kind;
+    std::size_t step = 0;
+    int column = 0;
+};
+
+template <typename T>
+concept PipelineArgument = std::is_same_v<T, PipelineValue> || std::is_convertible_v<T, QVariant>;
+
+struct PipelineStep {
+    enum class Kind {
+        Execute,
+        FetchRow,
+    };
+
+    Kind kind;
+    QString sql;
+    std::vector<std::variant<QVariant, PipelineValue>> arguments;
+};
+
+// Results of the steps of a pipeline that already ran
+struct PipelineState {
+    struct StepResult {
+        // Only set for execute steps
+        std::optional<QVariant> insertId;
+        QVariantList row;
+    };
+
+    std::vector<StepResult> steps;
+    // Unset until an execute step ran
+    std::optional<QVariant> lastInsertId;
+};
+
+template <typename ...Args>
+PipelineStep makePipelineStep(PipelineStep::Kind kind, const QString &sqlQuery, Args... args) {
+    const auto toArgument = [](auto &&arg) -> std::variant<QVariant, PipelineValue> {
+        if constexpr (std::is_same_v<std::decay_t<decltype(arg)>, PipelineValue>) {
+            return arg;
+        } else {
+            QVariant value = std::move(arg);
+            return value;
+        }
+    };
+    return PipelineStep { kind, sqlQuery, { toArgument(std::move(args))... } };
 }
 
+// File that is read by an import or written by an export. A path is opened on the database thread.
+using TransferTarget = std::variant<QIODevice *, QString>;
+
+// The future of a transaction tells whether it was committed, and carries the result of the transaction function if it returns one
+template <typename T>
+using TransactionResult = std::conditional_t<std::is_void_v<T>, bool, std::optional<T>>;
+
 void runDatabaseMigrations(QSqlDatabase &database, const QString &migrationDirectory);
 
 void printSqlError(const QSqlQuery &query);
@@ -107,31 +286,263 @@ public:
     AsyncSqlDatabase();
     ~AsyncSqlDatabase() override;
 
-    QFuture<void> establishConnection(const DatabaseConfiguration &configuration);
+    QFuture<void> establishConnection(const DatabaseConfiguration &configuration, bool readOnly = false);
+
+    // Waits for all submitted jobs, and closes the connection
+    void close();
+
+    // Number of jobs that were submitted, but did not finish yet
+    int pendingJobs() const;
+    // Whether jobs are queued or running, or grouped writes are not committed yet
+    bool hasPendingWrites() const;
+
+    QueueStatistics queueStatistics() const;
+
+    PreparedQueryCacheStatistics preparedQueryCacheStatistics() const;
+    QFuture<void> clearPreparedQueryCache();
+
+    std::vector<QueryStatistics> statistics() const;
+    std::vector<SlowQuery> slowQueries() const;
+
+    // Shared by all connections of a database, must be set before the connection is established
+    void setResultCache(std::shared_ptr<ResultCache> cache);
+
+    // Calls the function on the database thread after writes to a table that the query reads from were committed,
+    // and once right after the tables are known. Returns an id for unwatchTables.
+    quint64 watchTables(const QString &sqlQuery, std::function<void ()> changed);
+    void unwatchTables(quint64 id);
+
+    template <typename T, typename Sql, typename ...Args>
+    auto getResults(const Sql &sqlQuery, Args... args) -> QFuture<std::vector<T>> {
+        return runAsync(resultsJob<T>(sqlQuery, std::move(args)...));
+    }
+
+    template <typename T, typename Sql, typename ...Args>
+    auto getCachedResults(const Sql &sqlQuery, Args... args) -> QFuture<std::vector<T>> {
+        if (!hasResultCache()) {
+            return getResults<T>(sqlQuery, std::move(args)...);
+        }
+
+        QByteArray key = resultCacheKey(sqlText(sqlQuery), typeid(T).name(), { QVariant(args)... });
+        if (const auto cached = cachedResult(key)) {
+            // Hits don't need the database thread
+            QFutureInterface<std::vector<T>> interface(QFutureInterfaceBase::Started);
+            interface.reportResult(*static_cast<const std::vector<T> *>(cached.get()));
+            interface.reportFinished();
+            return interface.future();
+        }
+
+        return runAsync([this, key = std::move(key), sqlQuery, ...args = std::move(args)] {
+            // A write that commits while the query runs makes the result outdated
+            const quint64 generation = resultCacheGeneration();
+            auto query = executeQuery(sqlQuery, args...);
+            if (!query) {
+                return std::vector<T> {};
+            }
+
+            std::vector<T> rows;
+            // Rows cut short by a cancellation or an error would be handed out to every later hit
+            if (fetchAllRows<T>(*query, rows)) {
+                storeResult(key, sqlText(sqlQuery), generation, rows.size(), [&rows] {
+                    return std::make_shared<const std::vector<T>>(rows);
+                });
+            }
+            return rows;
+        });
+    }
 
-    template <typename T, typename ...Args>
-    auto getResults(const QString &sqlQuery, Args... args) -> QFuture<std::vector<T>> {
-        return runAsync([=, this] {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    // Qt 5 copies the result into the future, which would allocate it from the default resource again
+    template <typename T, typename Sql, typename ...Args>
+    auto getResults(std::pmr::memory_resource *resource, const Sql &sqlQuery, Args... args) -> QFuture<std::pmr::vector<T>> {
+        return runAsync([this, resource, sqlQuery, ...args = std::move(args)] {
             auto query = executeQuery(sqlQuery, args...);
 
             // If the query failed to execute, don't try to deserialize it
             if (!query) {
-                return std::vector<T> {};
+                return std::pmr::vector<T>(resource);
+            }
+
+            return retrieveRows<T>(*query, std::pmr::vector<T>(resource));
+        });
+    }
+#endif
+
+    template <typename T, typename Sql, typename ...Args>
+    auto streamResults(const Sql &sqlQuery, std::size_t chunkSize, std::function<void (std::vector<T> &&)> consumer, Args... args) -> QFuture<void> {
+        Q_ASSERT(chunkSize > 0);
+        chunkSize = std::max<std::size_t>(chunkSize, 1);
+
+        return runAsync([this, sqlQuery, chunkSize, consumer = std::move(consumer), ...args = std::move(args)] {
+            auto query = executeQuery(sqlQuery, args...);
+
+            // If the query failed to execute, don't try to deserialize it
+            if (!query) {
+                return;
             }
 
-            auto rows = parseRows<typename T::ColumnTypes>(retrieveRows(*query));
+            // Don't allocate a huge chunk up front if the result turns out to be small
+            const std::size_t reservedRows = std::min<std::size_t>(chunkSize, 1024);
+
+            std::vector<T> chunk;
+            chunk.reserve(reservedRows);
+            fetchRows<T>(*query, [&](T &&row) {
+                chunk.push_back(std::move(row));
 
-            std::vector<T> deserializedRows;
-            std::ranges::transform(rows, std::back_inserter(deserializedRows), [](auto &&row) {
-                return deserialize<T>(std::move(row));
+                if (chunk.size() >= chunkSize) {
+                    consumer(std::move(chunk));
+                    chunk.clear();
+                    chunk.reserve(reservedRows);
+                }
+                return true;
             });
-            return deserializedRows;
+
+            query->finish();
+
+            if (!chunk.empty()) {
+                consumer(std::move(chunk));
+            }
+        });
+    }
+
+    template <typename Sql, typename ...Args>
+    auto exportTo(TransferTarget target, FileFormat format, const Sql &sqlQuery, Args... args) -> QFuture<quint64> {
+        return runAsync([this, target = std::move(target), format, sqlQuery, ...args = std::move(args)] {
+            auto query = executeQuery(sqlQuery, args...);
+            if (!query) {
+                return quint64(0);
+            }
+
+            return exportRows(target, format, *query);
         });
     }
 
-    template <typename T, typename ...Args>
-    auto getResult(const QString &sqlQuery, Args... args) -> QFuture<std::optional<T>> {
-        return runAsync([=, this]() -> std::optional<T> {
+    QFuture<quint64> importFrom(TransferTarget source, const QString &table, const ImportOptions &options);
+
+    template <typename ...Ts, typename Sql, typename ...Args>
+    auto getColumns(const Sql &sqlQuery, Args... args) -> QFuture<std::tuple<std::vector<Ts>...>> {
+        return runAsync([this, sqlQuery, ...args = std::move(args)] {
+            auto query = executeQuery(sqlQuery, args...);
+
+            // If the query failed to execute, don't try to deserialize it
+            if (!query) {
+                return std::tuple<std::vector<Ts>...> {};
+            }
+
+            return retrieveColumns<Ts...>(*query);
+        });
+    }
+
+    template <typename T, typename Sql, typename ...Args>
+    auto getResult(const Sql &sqlQuery, Args... args) -> QFuture<std::optional<T>> {
+        return runAsync(resultJob<T>(sqlQuery, std::move(args)...));
+    }
+
+    template <typename Sql, typename ...Args>
+    auto execute(const Sql &sqlQuery, Args... args) -> QFuture<void> {
+        // The future only finishes once the group of writes was committed
+        if (groupCommitEnabled()) {
+            auto interface = std::make_shared<QFutureInterface<void>>();
+            // Otherwise waitForFinished returns right away on Qt 5
+            interface->reportStarted();
+            enqueue(interface, [this, interface, sqlQuery = sqlText(sqlQuery), write = writeJob(sqlQuery, std::move(args)...)] {
+                runGroupedWrite([interface](bool committed) {
+                    // The write was lost
+                    if (!committed) {
+                        interface->reportCanceled();
+                    }
+                    interface->reportFinished();
+                }, sqlQuery, write);
+            });
+            return interface->future();
+        }
+
+        return runAsync([write = writeJob(sqlQuery, std::move(args)...)] {
+            write();
+        });
+    }
+
+    // Like execute, but calls the callback instead of finishing a future
+    template <typename Sql, typename Callback, typename ...Args>
+    void executeWithCallback(QObject *context, Callback callback, const Sql &sqlQuery, Args... args) {
+        if (groupCommitEnabled()) {
+            auto receiver = callbackReceiver(context);
+            std::function<void ()> rejected;
+            if (canRejectJobs()) {
+                rejected = rejectedCallback<void>(receiver, context, callback);
+            }
+            enqueue(nullptr, [this, context = QPointer(context), receiver = std::move(receiver), callback = std::move(callback),
+                              sqlQuery = sqlText(sqlQuery), write = writeJob(sqlQuery, std::move(args)...)] {
+                if (receiver && !context) {
+                    return;
+                }
+
+                runGroupedWrite([=](bool) {
+                    invokeCallback(receiver, context, callback);
+                }, sqlQuery, write);
+            }, std::move(rejected));
+            return;
+        }
+
+        runWithCallback(context, [write = writeJob(sqlQuery, std::move(args)...)] {
+            write();
+        }, std::move(callback));
+    }
+
+    // Runs the function on the database thread, and passes its result to the callback on the thread of the context.
+    // If the context is destroyed before the callback runs, the function or the callback is skipped.
+    // Without a context, the callback runs directly on the database thread.
+    // If the queue is full, rejected is called like the callback, or if there is none, the callback with an empty result.
+    // Without a context, they run on the thread that submitted the job which caused the rejection.
+    // The job is stored in a std::function, so the function and the callback must be copyable.
+    template <typename Functor, typename Callback>
+    void runWithCallback(QObject *context, Functor func, Callback callback, std::function<void ()> rejected = {}) {
+        using ReturnType = std::invoke_result_t<Functor>;
+        auto receiver = callbackReceiver(context);
+        if (rejected) {
+            rejected = [receiver, context = QPointer(context), rejected = std::move(rejected)] {
+                invokeCallback(receiver, context, rejected);
+            };
+        } else if (canRejectJobs()) {
+            rejected = rejectedCallback<ReturnType>(receiver, context, callback);
+        }
+
+        enqueue(nullptr, [this, context = QPointer(context), receiver = std::move(receiver), func = std::move(func), callback = std::move(callback)] {
+            // Nobody is interested in the result anymore
+            if (receiver && !context) {
+                return;
+            }
+
+            if constexpr (std::is_void_v<ReturnType>) {
+                func();
+                finishQueryTiming();
+                invokeCallback(receiver, context, callback);
+            } else {
+                auto result = func();
+                finishQueryTiming();
+                invokeCallback(receiver, context, callback, std::move(result));
+            }
+        }, std::move(rejected));
+    }
+
+    // Jobs that are shared between the variants with futures and callbacks
+    template <typename T, typename Sql, typename ...Args>
+    auto resultsJob(const Sql &sqlQuery, Args... args) {
+        return [this, sqlQuery, ...args = std::move(args)] {
+            auto query = executeQuery(sqlQuery, args...);
+
+            // If the query failed to execute, don't try to deserialize it
+            if (!query) {
+                return std::vector<T> {};
+            }
+
+            return retrieveRows<T>(*query);
+        };
+    }
+
+    template <typename T, typename Sql, typename ...Args>
+    auto resultJob(const Sql &sqlQuery, Args... args) {
+        return [this, sqlQuery, ...args = std::move(args)]() -> std::optional<T> {
             auto query = executeQuery(sqlQuery, args...);
 
             // If the query failed to execute, don't try to deserialize it
@@ -139,52 +550,132 @@ public:
                 return {};
             }
 
-            if (const auto row = retrieveOptionalRow(*query)) {
-                return deserialize<T>(parseRow<typename T::ColumnTypes>(*row));
+            return retrieveOptionalRow<T>(*query);
+        };
+    }
+
+    // Returns whether the query succeeded
+    template <typename Sql, typename ...Args>
+    auto writeJob(const Sql &sqlQuery, Args... args) {
+        return [this, sqlQuery, ...args = std::move(args)] {
+            auto query = executeQuery(sqlQuery, args...);
+            if (query) {
+                query->finish();
             }
+            return query.has_value();
+        };
+    }
 
-            return {};
+    template <typename ...Args>
+    auto executeBatch(const QString &sqlQuery, std::vector<std::tuple<Args...>> rows) -> QFuture<void> {
+        // QSqlQuery::execBatch expects one list of values per placeholder
+        std::vector<QVariantList> columns(sizeof...(Args));
+        for (auto &column : columns) {
+            column.reserve(int(rows.size()));
+        }
+        for (auto &row : rows) {
+            int i = 0;
+            asyncdatabase_private::iterate_tuple(row, [&](auto &value) {
+                columns[i].append(QVariant(std::move(value)));
+                i++;
+            });
+        }
+
+        return runAsync([this, sqlQuery, columns = std::move(columns)] {
+            executeBatchQuery(sqlQuery, columns);
         });
     }
 
-    template <typename ...Args>
-    auto execute(const QString &sqlQuery, Args... args) -> QFuture<void> {
-        return runAsync([=, this] {
-            executeQuery(sqlQuery, args...);
+    // The function is stored in the std::function of the job, so it must be copyable
+    template <typename Func>
+    auto transaction(Func func) -> QFuture<TransactionResult<std::invoke_result_t<Func, Transaction &>>>;
+
+    // Runs the steps of a pipeline in a transaction, then the last step that produces the result
+    template <typename Result, typename LastStep>
+    auto runPipeline(std::vector<PipelineStep> steps, LastStep lastStep) -> QFuture<Result> {
+        return runAsync([this, steps = std::move(steps), lastStep = std::move(lastStep)]() -> Result {
+            if (!beginTransaction()) {
+                return {};
+            }
+
+            PipelineState state;
+            Result result {};
+            const bool succeeded = runPipelineSteps(steps, state) && lastStep(state, result);
+            if (!finishTransaction(succeeded)) {
+                return {};
+            }
+            return result;
+        });
+    }
+
+    template <typename T>
+    auto pipelineResults(std::vector<PipelineStep> steps, PipelineStep last) -> QFuture<std::vector<T>> {
+        return runPipeline<std::vector<T>>(std::move(steps), [this, last = std::move(last)](const PipelineState &state, std::vector<T> &result) {
+            auto query = executePipelineStep(last, state);
+            if (!query) {
+                return false;
+            }
+            result = retrieveRows<T>(*query);
+            return true;
+        });
+    }
+
+    template <typename T>
+    auto pipelineResult(std::vector<PipelineStep> steps, PipelineStep last) -> QFuture<std::optional<T>> {
+        return runPipeline<std::optional<T>>(std::move(steps), [this, last = std::move(last)](const PipelineState &state, std::optional<T> &result) {
+            auto query = executePipelineStep(last, state);
+            if (!query) {
+                return false;
+            }
+            result = retrieveOptionalRow<T>(*query);
+            return true;
         });
     }
 
+    QFuture<bool> pipelineCommit(std::vector<PipelineStep> steps);
+
     auto runMigrations(const QString &migrationDirectory) -> QFuture<void>;
+    void runMigrations(QObject *context, std::function<void ()> callback, const QString &migrationDirectory, std::function<void ()> rejected = {});
 
     auto setCurrentMigrationLevel(const QString &migrationName) -> QFuture<void>;
 
 private:
-    template <typename ...Args>
-    std::optional<QSqlQuery> executeQuery(const QString &sqlQuery, Args... args) {
+    template <typename Sql, typename ...Args>
+    std::optional<QSqlQuery> executeQuery(const Sql &sqlQuery, const Args &...args) {
         auto query = prepareQuery(db(), sqlQuery);
         if (!query) {
             return {};
         }
 
-        auto argsTuple = std::make_tuple<Args...>(std::move(args)...);
         int i = 0;
-        asyncdatabase_private::iterate_tuple(argsTuple, [&](auto &arg) {
-            query->bindValue(i, arg);
-            i++;
-        });
-        return runQuery(*query);
+        (query->bindValue(i++, args), ...);
+
+        if (!runQuery(*query)) {
+            return {};
+        }
+        return query;
     }
 
     template <typename Functor>
     QFuture<std::invoke_result_t<Functor>> runAsync(Functor func) {
         using ReturnType = std::invoke_result_t<Functor>;
         auto interface = std::make_shared<QFutureInterface<ReturnType>>();
-        QMetaObject::invokeMethod(this, [interface, func] {
+        // Otherwise waitForFinished and result return right away on Qt 5
+        interface->reportStarted();
+        enqueue(interface, [this, interface, func = std::move(func)] {
             if constexpr (!std::is_same_v<ReturnType, void>) {
                 auto result = func();
+                // Statistics should be up to date once the future finishes
+                finishQueryTiming();
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+                interface->reportAndMoveResult(std::move(result));
+#else
+                // Qt 5 always copies the result into the future
                 interface->reportResult(result);
+#endif
             } else {
                 func();
+                finishQueryTiming();
             }
 
             interface->reportFinished();
@@ -193,17 +684,330 @@ private:
         return interface->future();
     }
 
-    Row retrieveRow(const QSqlQuery &query);
-    Rows retrieveRows(QSqlQuery &query);
-    std::optional<Row> retrieveOptionalRow(QSqlQuery &query);
+    // An object on the thread of the context, which unlike the context is never destroyed while callbacks are posted to it.
+    // There is one per thread, until the connection is closed. Null without a context.
+    std::shared_ptr<QObject> callbackReceiver(QObject *context);
+
+    // Passes an empty result to the callback of a job that was rejected, as if its query failed.
+    // Either the job or the rejected callback runs, but both need the callback, so it is copied.
+    template <typename Result, typename Callback>
+    static std::function<void ()> rejectedCallback(const std::shared_ptr<QObject> &receiver, QObject *context, const Callback &callback) {
+        return [receiver, context = QPointer(context), callback] {
+            if constexpr (std::is_void_v<Result>) {
+                invokeCallback(receiver, context, callback);
+            } else {
+                invokeCallback(receiver, context, callback, Result {});
+            }
+        };
+    }
+
+    template <typename Callback, typename ...Result>
+    static void invokeCallback(const std::shared_ptr<QObject> &receiver, const QPointer<QObject> &context, Callback callback, Result ...result) {
+        if (!receiver) {
+            callback(std::move(result)...);
+            return;
+        }
+
+        // The context can be destroyed at any time on its own thread, so it is only safe to check it there.
+        // Always queued, so a rejected job doesn't call the callback from inside of the call that submitted it.
+        QMetaObject::invokeMethod(receiver.get(), [receiver, context, callback = std::move(callback), ...result = std::move(result)]() mutable {
+            if (context) {
+                callback(std::move(result)...);
+            }
+        }, Qt::QueuedConnection);
+    }
+
+    template <typename T, typename Container = std::vector<T>>
+    Container retrieveRows(QSqlQuery &query, Container rows = {}) {
+        fetchAllRows<T>(query, rows);
+        return rows;
+    }
+
+    // Returns false if the rows are incomplete, because the job was canceled or fetching failed
+    template <typename T, typename Container>
+    bool fetchAllRows(QSqlQuery &query, Container &rows) {
+        // Most drivers don't know the size of the result in advance, SQLite never does
+        if (const int size = query.size(); size > 0) {
+            rows.reserve(size);
+        }
+        const bool complete = fetchRows<T>(query, [&](T &&row) {
+            rows.push_back(std::move(row));
+            return true;
+        });
+        // Release the result, so the cached query doesn't hold on to it
+        query.finish();
+        return complete;
+    }
+
+    template <typename T>
+    std::optional<T> retrieveOptionalRow(QSqlQuery &query) {
+        std::optional<T> row;
+        fetchFirstRow<T>(query, row);
+        return row;
+    }
+
+    // Returns false if the job was canceled or fetching failed before the first row was known
+    template <typename T>
+    bool fetchFirstRow(QSqlQuery &query, std::optional<T> &row) {
+        const bool complete = fetchRows<T>(query, [&](T &&first) {
+            row = std::move(first);
+            return false;
+        });
+        query.finish();
+        return complete;
+    }
+
+    template <typename ...Ts>
+    std::tuple<std::vector<Ts>...> retrieveColumns(QSqlQuery &query) {
+        std::tuple<std::vector<Ts>...> columns;
+        if (const int size = query.size(); size > 0) {
+            std::apply([size](auto &...column) {
+                (column.reserve(size), ...);
+            }, columns);
+        }
+        fetchRows(query, [](const QSqlQuery &query) {
+            return parseRow<std::tuple<Ts...>>(query);
+        }, [&](std::tuple<Ts...> &&row) {
+            appendToColumns(columns, std::move(row), std::index_sequence_for<Ts...>());
+            return true;
+        });
+        query.finish();
+        return columns;
+    }
+
+    template <typename T, typename Consumer>
+    bool fetchRows(QSqlQuery &query, Consumer consumer) {
+        return fetchRows(query, [](const QSqlQuery &query) {
+            return deserialize<T>(parseRow<typename T::ColumnTypes>(query));
+        }, std::move(consumer));
+    }
+
+    // Reads rows until the consumer returns false, and measures the time spent if needed.
+    // Returns false if reading stopped early because the job was canceled or a row could not be fetched.
+    template <typename Reader, typename Consumer>
+    bool fetchRows(QSqlQuery &query, Reader read, Consumer consumer) {
+        if (!measuringQuery()) {
+            while (!isCurrentJobCanceled()) {
+                if (!query.next()) {
+                    return !query.lastError().isValid();
+                }
+                if (!consumer(read(query))) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        using Clock = std::chrono::steady_clock;
+        Clock::duration fetch {};
+        Clock::duration deserialization {};
+        quint64 rows = 0;
+        bool complete = false;
+        while (!isCurrentJobCanceled()) {
+            const auto start = Clock::now();
+            const bool hasRow = query.next();
+            const auto fetched = Clock::now();
+            fetch += fetched - start;
+            if (!hasRow) {
+                complete = !query.lastError().isValid();
+                break;
+            }
+
+            auto row = read(query);
+            deserialization += Clock::now() - fetched;
+            rows++;
+
+            if (!consumer(std::move(row))) {
+                complete = true;
+                break;
+            }
+        }
+        recordFetch(fetch, deserialization, rows);
+        return complete;
+    }
+
+    // Registered queries don't need to be looked up by their text
+    template <RegisteredQuery Query>
+    std::optional<QSqlQuery> prepareQuery(const QSqlDatabase &database, const Query &) {
+        return prepareRegisteredQuery(database, Query::id(), Query::sql());
+    }
 
     QSqlDatabase &db();
 
+    // Adds a job to the queue of the current priority.
+    // If the future is canceled before the job starts, the job is skipped.
+    // If the queue is full and the job is rejected or later dropped, the future is canceled and rejected is called,
+    // on the thread that submitted the job which caused it.
+    void enqueue(std::shared_ptr<QFutureInterfaceBase> future, std::function<void ()> job, std::function<void ()> rejected = {});
+    // Cancels a job that will never run
+    void rejectJob(const std::shared_ptr<QFutureInterfaceBase> &future, const std::function<void ()> &rejected);
+    // Whether the queue is bounded with a policy that rejects or drops jobs, so they need a rejected callback
+    bool canRejectJobs() const;
+    void finishJob();
+    // Runs the job that should run next according to the priorities
+    void runNextJob();
+    // Whether the future of the job that is currently running was canceled
+    bool isCurrentJobCanceled() const;
+
+    // Timing of the queries of the current job, if statistics or a query observer are enabled.
+    // A query is measured from being prepared until the next query starts or the job finishes.
+    void startQueryTiming(const QString &sqlQuery);
+    void recordExecution(const QSqlQuery &query, std::chrono::steady_clock::time_point start, bool succeeded);
+    void recordFetch(std::chrono::steady_clock::duration fetch, std::chrono::steady_clock::duration deserialization, quint64 rows);
+    void finishQueryTiming();
+    bool measuringQuery() const;
+    void logSlowQuery(const QueryTiming &timing);
+
     // non-template helper functions to allow patching a much as possible in the shared library
     std::optional<QSqlQuery> prepareQuery(const QSqlDatabase &database, const QString &sqlQuery);
-    QSqlQuery runQuery(QSqlQuery &query);
+    std::optional<QSqlQuery> prepareUncachedQuery(const QSqlDatabase &database, const QString &sqlQuery);
+    std::optional<QSqlQuery> prepareRegisteredQuery(const QSqlDatabase &database, std::size_t id, const QString &sqlQuery);
+    bool runQuery(QSqlQuery &query);
+    void executeBatchQuery(const QString &sqlQuery, const std::vector<QVariantList> &columns);
+    // Result cache, see ThreadedDatabase::getCachedResults
+    bool hasResultCache() const;
+    static QByteArray resultCacheKey(const QString &sqlQuery, const char *type, const QVariantList &args);
+    std::shared_ptr<const void> cachedResult(const QByteArray &key);
+    quint64 resultCacheGeneration() const;
+    // Stores the copy of the result, unless the tables it read from changed since the generation
+    void storeResult(const QByteArray &key, const QString &sqlQuery, quint64 generation, std::size_t rows, const std::function<std::shared_ptr<const void> ()> &copy);
+    // Collects the tables that the query reads from, returns false if they can't be known
+    bool findReadTables(const QString &sqlQuery, std::unordered_set<std::string> &tables);
+    // Hooks that track which tables are written to, for the result cache and watchers
+    void installChangeHooks();
+    void notifyWatchers();
+
+    // Streams rows between a file and the database, see ThreadedDatabase::importFrom and ThreadedDatabase::exportTo
+    quint64 importRows(const TransferTarget &source, const QString &table, const ImportOptions &options);
+    quint64 exportRows(const TransferTarget &target, FileFormat format, QSqlQuery &query);
+    bool insertBatch(QSqlQuery &query, const QString &sqlQuery, std::vector<QVariantList> &columns);
+    void reportProgress(int value);
+    // Commits the open group and closes the database, on the thread of the connection
+    void closeConnection();
+    void closeDatabase();
+    bool groupCommitEnabled() const;
+    // Calls finished once the write was committed, or with false if committing the group failed
+    void runGroupedWrite(std::function<void (bool committed)> finished, const QString &sqlQuery, const std::function<bool ()> &write);
+    void commitGroup();
+    bool beginTransaction();
+    bool finishTransaction(bool commit);
+    void rollbackAfterException(std::exception_ptr exception);
+    bool runPipelineSteps(const std::vector<PipelineStep> &steps, PipelineState &state);
+    std::optional<QSqlQuery> executePipelineStep(const PipelineStep &step, const PipelineState &state);
+
+    friend class Transaction;
 
     std::unique_ptr<AsyncSqlDatabasePrivate> d;
 };
 
+///
+/// Synchronous access to the database from inside of a transaction function.
+/// It must only be used on the database thread, while the transaction function runs.
+///
+class Transaction {
+public:
+    /// Execute an SQL query, ignoring the result. Returns whether the query succeeded.
+    template <typename Sql, typename ...Args>
+    bool execute(const Sql &sqlQuery, const Args &...args) {
+        auto query = m_db.executeQuery(sqlQuery, args...);
+        if (!query) {
+            m_failed = true;
+            return false;
+        }
+
+        m_lastInsertId = query->lastInsertId();
+        query->finish();
+        return true;
+    }
+
+    /// Id of the row that was inserted by the last call to execute, if the database supports it
+    const QVariant &lastInsertId() const {
+        return m_lastInsertId;
+    }
+
+    /// Execute an SQL query and deserialize all rows of the result
+    template <typename T, typename Sql, typename ...Args>
+    std::vector<T> getResults(const Sql &sqlQuery, const Args &...args) {
+        auto query = m_db.executeQuery(sqlQuery, args...);
+        if (!query) {
+            m_failed = true;
+            return {};
+        }
+
+        // Writes based on a partial result must not be committed
+        std::vector<T> rows;
+        if (!m_db.fetchAllRows<T>(*query, rows)) {
+            m_failed = true;
+        }
+        return rows;
+    }
+
+    /// Execute an SQL query and deserialize the first row of the result
+    template <typename T, typename Sql, typename ...Args>
+    std::optional<T> getResult(const Sql &sqlQuery, const Args &...args) {
+        auto query = m_db.executeQuery(sqlQuery, args...);
+        if (!query) {
+            m_failed = true;
+            return {};
+        }
+
+        std::optional<T> row;
+        if (!m_db.fetchFirstRow<T>(*query, row)) {
+            m_failed = true;
+        }
+        return row;
+    }
+
+    /// Roll back instead of committing once the transaction function returns
+    void rollback() {
+        m_failed = true;
+    }
+
+    /// Whether a query failed, reading a result was cut short, or a rollback was requested
+    bool failed() const {
+        return m_failed;
+    }
+
+private:
+    friend class AsyncSqlDatabase;
+
+    explicit Transaction(AsyncSqlDatabase &db)
+        : m_db(db)
+    {
+    }
+
+    AsyncSqlDatabase &m_db;
+    QVariant m_lastInsertId;
+    bool m_failed = false;
+};
+
+template <typename Func>
+auto AsyncSqlDatabase::transaction(Func func) -> QFuture<TransactionResult<std::invoke_result_t<Func, Transaction &>>>
+{
+    using ReturnType = std::invoke_result_t<Func, Transaction &>;
+    return runAsync([this, func = std::move(func)]() -> TransactionResult<ReturnType> {
+        if (!beginTransaction()) {
+            return {};
+        }
+
+        Transaction transaction(*this);
+        try {
+            // The caller may have canceled the future while short queries ran, which nothing interrupts
+            if constexpr (std::is_void_v<ReturnType>) {
+                func(transaction);
+                return finishTransaction(!transaction.failed() && !isCurrentJobCanceled());
+            } else {
+                auto result = func(transaction);
+                if (finishTransaction(!transaction.failed() && !isCurrentJobCanceled())) {
+                    return result;
+                }
+                return {};
+            }
+        } catch (...) {
+            rollbackAfterException(std::current_exception());
+            return {};
+        }
+    });
+}
+
 }
@@ -2,13 +2,21 @@
 //
 // SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only
 
+#include <QBuffer>
+#include <QDir>
+#include <QSemaphore>
 #include <QTest>
 #include <QTimer>
+#include <QTemporaryDir>
 
 #include <QCoro/QCoroTask>
 #include <QCoro/QCoroFuture>
 
+#include <atomic>
+#include <memory_resource>
+
 #include <threadeddatabase.h>
+#include <shardeddatabase.h>
 
 struct TestCustom {
     using ColumnTypes = std::tuple<int, QString>;
@@ -31,6 +39,58 @@ public:
     QString data;
 };
 
+struct TestMoveOnly {
+    using ColumnTypes = std::tuple<int, QString>;
+
+    static auto fromSql(ColumnTypes columns) {
+        auto [id, data] = std::move(columns);
+        return TestMoveOnly { id, std::make_unique<QString>(std::move(data)) };
+    }
+
+public:
+    int id;
+    std::unique_ptr<QString> data;
+};
+
+// Calls a hook on the database thread for every row it deserializes
+struct TestHooked {
+    using ColumnTypes = std::tuple<int, QString>;
+
+    static inline std::function<void ()> onRow;
+
+    static auto fromSql(ColumnTypes columns) {
+        if (onRow) {
+            onRow();
+        }
+        auto [id, data] = columns;
+        return TestHooked { id, data };
+    }
+
+public:
+    int id;
+    QString data;
+};
+
+// Counts allocations, and forwards them to the default resource
+class CountingResource : public std::pmr::memory_resource {
+public:
+    std::atomic_int allocations = 0;
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        allocations++;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *pointer, std::size_t bytes, std::size_t alignment) override {
+        std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+};
+
 class SqliteTest : public QObject {
     Q_OBJECT
 
@@ -70,6 +130,993 @@ private Q_SLOTS:
             Q_ASSERT(list2.at(0).data == "Hello World");
 
 
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testExecuteBatch() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+
+            std::vector<std::tuple<int, QString>> rows = {{10, "first"}, {11, "second"}, {12, "third"}};
+            co_await db->executeBatch("INSERT INTO test (id, data) VALUES (?, ?)", rows);
+
+            auto list = co_await db->getResults<TestDefault>("SELECT * FROM test WHERE id >= 10 ORDER BY id ASC");
+            Q_ASSERT(list.size() == 3);
+            Q_ASSERT(list.at(2).data == "third");
+
+            // A failing row rolls back the whole batch
+            std::vector<std::tuple<int, QString>> conflicting = {{20, "new"}, {10, "duplicate"}};
+            co_await db->executeBatch("INSERT INTO test (id, data) VALUES (?, ?)", conflicting);
+            auto opt = co_await db->getResult<TestDefault>("SELECT * FROM test WHERE id = 20");
+            Q_ASSERT(!opt.has_value());
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testStreamResults() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+            co_await db->execute("INSERT INTO test (data) VALUES (?)", "FutureSQL");
+            co_await db->execute("INSERT INTO test (data) VALUES (?)", "Streaming");
+
+            // Only accessed from the database thread until the future finished
+            std::vector<size_t> chunkSizes;
+            co_await db->streamResults<TestDefault>("SELECT * FROM test ORDER BY id ASC", 2, [&chunkSizes](std::vector<TestDefault> &&chunk) {
+                chunkSizes.push_back(chunk.size());
+            });
+            Q_ASSERT(chunkSizes.size() == 2);
+            Q_ASSERT(chunkSizes.at(0) == 2);
+            Q_ASSERT(chunkSizes.at(1) == 1);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testMemoryResource() {
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+        QSKIP("QFuture copies results in Qt 5");
+#else
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+            co_await db->execute("INSERT INTO test (data) VALUES (?)", "FutureSQL");
+
+            CountingResource resource;
+            auto future = db->getResults<TestDefault>(&resource, "SELECT * FROM test ORDER BY id");
+            future.waitForFinished();
+            const int allocations = resource.allocations;
+            Q_ASSERT(allocations > 0);
+
+            // Taking the result out of the future keeps its resource, and doesn't copy the rows
+            const auto list = future.takeResult();
+            Q_ASSERT(list.get_allocator().resource() == &resource);
+            Q_ASSERT(resource.allocations == allocations);
+            Q_ASSERT(list.size() == 2);
+            Q_ASSERT(list.front().data == QStringLiteral("Hello World"));
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+#endif
+    }
+
+    void testColumns() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+            co_await db->execute("INSERT INTO test (data) VALUES (?)", "FutureSQL");
+
+            const auto [ids, data] = co_await db->getColumns<int, QString>("SELECT id, data FROM test ORDER BY id");
+            Q_ASSERT(ids.size() == 2);
+            Q_ASSERT(ids[1] == 2);
+            Q_ASSERT(data.size() == 2);
+            Q_ASSERT(data[0] == QStringLiteral("Hello World"));
+            Q_ASSERT(data[1] == QStringLiteral("FutureSQL"));
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testCallbacks() {
+        DatabaseConfiguration cfg;
+        cfg.setDatabaseName(":memory:");
+        cfg.setType(DATABASE_TYPE_SQLITE);
+        auto db = ThreadedDatabase::establishConnection(cfg);
+
+        bool created = false;
+        db->execute(this, [&created] {
+            created = true;
+        }, "CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)");
+        // Without a context, the callback is called on the database thread
+        std::atomic_bool onDatabaseThread = false;
+        db->execute(nullptr, [&onDatabaseThread, &db] {
+            onDatabaseThread = QThread::currentThread() == db.get();
+        }, "INSERT INTO test (data) VALUES (?)", "Hello World");
+
+        // Keep the database thread busy, so the next query stays in the queue
+        db->transaction([](Transaction &) {
+            QThread::msleep(100);
+        });
+        auto context = std::make_unique<QObject>();
+        db->execute(context.get(), [] {
+            Q_ASSERT(false);
+        }, "INSERT INTO test (data) VALUES (?)", "Skipped");
+        context.reset();
+
+        std::optional<std::vector<TestDefault>> list;
+        db->getResults<TestDefault>(this, [this, &list](std::vector<TestDefault> &&rows) {
+            Q_ASSERT(QThread::currentThread() == thread());
+            list = std::move(rows);
+        }, "SELECT * FROM test");
+
+        while (!list) {
+            QCoreApplication::processEvents();
+        }
+        Q_ASSERT(created);
+        Q_ASSERT(onDatabaseThread);
+        Q_ASSERT(list->size() == 1);
+
+        // Destroyed after the query ran, but before the callback was delivered
+        context = std::make_unique<QObject>();
+        db->execute(context.get(), [] {
+            Q_ASSERT(false);
+        }, "INSERT INTO test (data) VALUES (?)", "Not delivered");
+        db->execute("SELECT 1").waitForFinished();
+        context.reset();
+        QCoreApplication::processEvents();
+    }
+
+    void testPipeline() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+
+            const auto list = co_await db->pipeline()
+                .execute("INSERT INTO test (data) VALUES (?)", "FutureSQL")
+                .execute("INSERT INTO test (data) VALUES ((SELECT data FROM test WHERE id = ?) || '!')", Pipeline::lastInsertId())
+                .fetchRow("SELECT data FROM test WHERE id = ?", Pipeline::insertId(0))
+                .getResults<TestDefault>("SELECT * FROM test WHERE data = ? OR id = ? ORDER BY id", Pipeline::column(2, 0), Pipeline::lastInsertId());
+            Q_ASSERT(list.size() == 2);
+            Q_ASSERT(list[0].id == 2);
+            Q_ASSERT(list[1].data == QStringLiteral("FutureSQL!"));
+
+            QVariant insertId;
+            co_await db->transaction([&insertId](Transaction &transaction) {
+                transaction.execute("INSERT INTO test (data) VALUES (?)", "Transaction");
+                insertId = transaction.lastInsertId();
+            });
+            Q_ASSERT(insertId.toInt() == 4);
+
+            // Referring to a step that doesn't exist rolls back the pipeline, instead of writing NULL
+            bool committed = co_await db->pipeline()
+                .execute("INSERT INTO test (data) VALUES (?)", "Rolled back")
+                .execute("INSERT INTO test (data) VALUES (?)", Pipeline::insertId(5))
+                .commit();
+            Q_ASSERT(!committed);
+            // Just like referring to a row that wasn't found
+            committed = co_await db->pipeline()
+                .fetchRow("SELECT data FROM test WHERE id = ?", 100)
+                .execute("INSERT INTO test (data) VALUES (?)", Pipeline::column(0, 0))
+                .commit();
+            Q_ASSERT(!committed);
+            const auto count = co_await db->getResult<SingleValue<int>>("SELECT count(*) FROM test");
+            Q_ASSERT(count->value == 4);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testImportExport() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+            const std::vector<std::tuple<QVariant>> values = {
+                { QStringLiteral("a,b") }, { QStringLiteral("\"quoted\"") }, { QStringLiteral("line\nbreak") },
+                { QStringLiteral("crlf\r\nbreak") }, { QStringLiteral("tab\t and \\") }, { QStringLiteral("") }, { QVariant() },
+                // Text that looks like an encoded blob, and a blob
+                { QStringLiteral("\\x41") }, { QByteArray("a\0\nb", 4) },
+            };
+            co_await db->executeBatch("INSERT INTO test (data) VALUES (?)", values);
+            const auto original = co_await db->getResults<TestDefault>("SELECT * FROM test ORDER BY id");
+            Q_ASSERT(original.size() == 10);
+            const auto originalTypes = co_await db->getResults<SingleValue<QString>>("SELECT typeof(data) FROM test ORDER BY id");
+            Q_ASSERT(originalTypes.back().value == QStringLiteral("blob"));
+
+            for (const auto format : { FileFormat::Csv, FileFormat::Tsv, FileFormat::Binary }) {
+                QBuffer buffer;
+                buffer.open(QIODevice::ReadWrite);
+                const auto exported = co_await db->exportTo(&buffer, format, "SELECT * FROM test ORDER BY id");
+                Q_ASSERT(exported == 10);
+
+                co_await db->execute("CREATE TABLE copy (id INTEGER PRIMARY KEY NOT NULL, data TEXT)");
+                buffer.seek(0);
+                // Several batches and commits
+                const auto imported = co_await db->importFrom(&buffer, "copy", ImportOptions { .format = format, .batchSize = 2, .commitInterval = 4 });
+                Q_ASSERT(imported == 10);
+
+                const auto copy = co_await db->getResults<TestDefault>("SELECT * FROM copy ORDER BY id");
+                Q_ASSERT(copy.size() == original.size());
+                for (size_t i = 0; i < copy.size(); i++) {
+                    Q_ASSERT(copy[i].id == original[i].id);
+                    Q_ASSERT(copy[i].data == original[i].data);
+                    Q_ASSERT(copy[i].data.isNull() == original[i].data.isNull());
+                }
+                const auto types = co_await db->getResults<SingleValue<QString>>("SELECT typeof(data) FROM copy ORDER BY id");
+                Q_ASSERT(types.size() == originalTypes.size());
+                for (size_t i = 0; i < types.size(); i++) {
+                    Q_ASSERT(types[i].value == originalTypes[i].value);
+                }
+                co_await db->execute("DROP TABLE copy");
+            }
+
+            // A device that can't be written to exports nothing
+            QBuffer readOnly;
+            readOnly.open(QIODevice::ReadOnly);
+            const auto exported = co_await db->exportTo(&readOnly, FileFormat::Csv, "SELECT * FROM test ORDER BY id");
+            Q_ASSERT(exported == 0);
+
+            // A record with the wrong number of values rolls back the rows since the last commit
+            QTemporaryDir dir;
+            const QString path = dir.filePath(QStringLiteral("import.csv"));
+            {
+                QFile file(path);
+                file.open(QIODevice::WriteOnly);
+                file.write("data\nfirst\nsecond\nthird,too many\n");
+            }
+            const auto imported = co_await db->importFrom(path, "test", ImportOptions { .batchSize = 1, .commitInterval = 1 });
+            Q_ASSERT(imported == 2);
+            const auto count = co_await db->getResult<SingleValue<int>>("SELECT count(*) FROM test");
+            Q_ASSERT(count->value == 12);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testResultCache() {
+        bool finished = false;
+        bool supported = true;
+        QMetaObject::invokeMethod(this, [&finished, &supported]() -> QCoro::Task<> {
+            DatabaseConfiguration cfg;
+            cfg.setDatabaseName(":memory:");
+            cfg.setType(DATABASE_TYPE_SQLITE);
+            cfg.setResultCacheSize(100);
+            auto db = ThreadedDatabase::establishConnection(cfg);
+            co_await db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)");
+            co_await db->execute("CREATE TABLE other (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL)");
+            co_await db->execute("INSERT INTO test (data) VALUES (?)", "Hello World");
+
+            auto list = co_await db->getCachedResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(list.size() == 1);
+            // Needs the SQLite library of the driver
+            if (db->resultCacheStatistics().size == 0) {
+                supported = false;
+                finished = true;
+                co_return;
+            }
+
+            // The future of a hit is already finished
+            auto future = db->getCachedResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(future.isFinished());
+            Q_ASSERT(future.result().size() == 1);
+            auto statistics = db->resultCacheStatistics();
+            Q_ASSERT(statistics.hits == 1);
+            Q_ASSERT(statistics.misses == 1);
+
+            // Different parameters are cached separately
+            list = co_await db->getCachedResults<TestDefault>("SELECT * FROM test WHERE id = ?", 2);
+            Q_ASSERT(list.empty());
+            Q_ASSERT(db->resultCacheStatistics().size == 2);
+
+            // Writing to a different table keeps the results
+            co_await db->execute("INSERT INTO other DEFAULT VALUES");
+            Q_ASSERT(db->resultCacheStatistics().size == 2);
+
+            co_await db->execute("INSERT INTO test (data) VALUES (?)", "FutureSQL");
+            statistics = db->resultCacheStatistics();
+            Q_ASSERT(statistics.invalidations == 2);
+            Q_ASSERT(statistics.size == 0);
+            list = co_await db->getCachedResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(list.size() == 2);
+
+            // Deleting all rows is noticed as well
+            co_await db->execute("DELETE FROM test");
+            list = co_await db->getCachedResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(list.empty());
+
+            // A write that is still queued is not missed
+            list = co_await db->getCachedResults<TestDefault>("SELECT * FROM test");
+            db->execute("INSERT INTO test (data) VALUES (?)", "Queued");
+            list = co_await db->getCachedResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(list.size() == 1);
+            co_await db->execute("DELETE FROM test");
+            list = co_await db->getCachedResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(list.empty());
+
+            // Results of queries that use the current time are not cached
+            co_await db->getCachedResults<TestDefault>("SELECT id, datetime('now') FROM other");
+            Q_ASSERT(db->resultCacheStatistics().size == 1);
+
+            db->clearResultCache();
+            Q_ASSERT(db->resultCacheStatistics().size == 0);
+
+            // A read that is canceled while fetching doesn't cache the rows it got so far
+            for (int i = 0; i < 5; i++) {
+                co_await db->execute("INSERT INTO test (data) VALUES (?)", "Row");
+            }
+            QFuture<std::vector<TestHooked>> canceled;
+            QSemaphore submitted;
+            std::atomic_bool cancel = true;
+            TestHooked::onRow = [&] {
+                if (cancel.exchange(false)) {
+                    submitted.acquire();
+                    canceled.cancel();
+                }
+            };
+            canceled = db->getCachedResults<TestHooked>("SELECT * FROM test");
+            submitted.release();
+            // Runs after the canceled read finished
+            co_await db->getResults<TestDefault>("SELECT * FROM test");
+            const auto misses = db->resultCacheStatistics().misses;
+            const auto rows = co_await db->getCachedResults<TestHooked>("SELECT * FROM test");
+            TestHooked::onRow = {};
+            Q_ASSERT(canceled.isCanceled());
+            Q_ASSERT(rows.size() == 5);
+            Q_ASSERT(db->resultCacheStatistics().misses == misses + 1);
+            Q_ASSERT(db->resultCacheStatistics().size == 1);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+        if (!supported) {
+            QSKIP("The SQLite driver uses a different SQLite library");
+        }
+    }
+
+    void testBoundedQueue() {
+        DatabaseConfiguration cfg;
+        cfg.setDatabaseName(":memory:");
+        cfg.setType(DATABASE_TYPE_SQLITE);
+        cfg.setMaxQueuedJobs(2);
+        cfg.setQueueFullPolicy(QueueFullPolicy::Fail);
+        auto db = ThreadedDatabase::establishConnection(cfg);
+        db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)").waitForFinished();
+
+        // A job is only counted as finished after its future finished
+        const auto idle = [&db]() {
+            return QTest::qWaitFor([&db]() { return db->queueStatistics().depth == 0; });
+        };
+        const auto busy = [&db]() {
+            return db->transaction([](Transaction &) {
+                QThread::msleep(200);
+            });
+        };
+
+        QVERIFY(idle());
+
+        auto running = busy();
+        auto queued = db->execute("INSERT INTO test (data) VALUES (?)", "queued");
+        auto rejected = db->execute("INSERT INTO test (data) VALUES (?)", "rejected");
+        QVERIFY(rejected.isCanceled());
+        auto statistics = db->queueStatistics();
+        QVERIFY(statistics.depth == 2);
+        QVERIFY(statistics.highWaterMark == 2);
+        QVERIFY(statistics.rejected == 1);
+        // Rejected callbacks are called with an empty result
+        bool rejectedCallback = false;
+        db->getResults<TestDefault>(this, [&rejectedCallback](std::vector<TestDefault> &&rows) {
+            QVERIFY(rows.empty());
+            rejectedCallback = true;
+        }, "SELECT * FROM test");
+        QVERIFY(!rejectedCallback);
+        QVERIFY(QTest::qWaitFor([&rejectedCallback]() { return rejectedCallback; }));
+        QVERIFY(db->queueStatistics().rejected == 2);
+        queued.waitForFinished();
+        QVERIFY(!queued.isCanceled());
+        QVERIFY(idle());
+
+        // Background queries make room for new ones
+        cfg.setQueueFullPolicy(QueueFullPolicy::DropOldestBackground);
+        db = ThreadedDatabase::establishConnection(cfg);
+        db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)").waitForFinished();
+        QVERIFY(idle());
+        running = busy();
+        auto background = ThreadedDatabase::withPriority(QueryPriority::Background, [&db]() {
+            return db->execute("INSERT INTO test (data) VALUES (?)", "background");
+        });
+        auto interactive = db->execute("INSERT INTO test (data) VALUES (?)", "interactive");
+        QVERIFY(background.isCanceled());
+        QVERIFY(db->execute("INSERT INTO test (data) VALUES (?)", "rejected").isCanceled());
+        interactive.waitForFinished();
+        statistics = db->queueStatistics();
+        QVERIFY(statistics.dropped == 1);
+        QVERIFY(statistics.rejected == 1);
+
+        // Submitters wait for room
+        cfg.setMaxQueuedJobs(1);
+        cfg.setQueueFullPolicy(QueueFullPolicy::Block);
+        db = ThreadedDatabase::establishConnection(cfg);
+        db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)").waitForFinished();
+        QFuture<void> last;
+        for (int i = 0; i < 10; i++) {
+            last = db->execute("INSERT INTO test (data) VALUES (?)", QString::number(i));
+        }
+        last.waitForFinished();
+        const auto count = db->getResult<SingleValue<int>>("SELECT count(*) FROM test").result();
+        QVERIFY(count && count->value == 10);
+        QVERIFY(db->queueStatistics().highWaterMark == 1);
+    }
+
+    void testThreadPool() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto pool = std::make_shared<DatabaseThreadPool>(2);
+            Q_ASSERT(pool->threadCount() == 2);
+
+            DatabaseConfiguration cfg;
+            cfg.setDatabaseName(":memory:");
+            cfg.setType(DATABASE_TYPE_SQLITE);
+            cfg.setThreadPool(pool);
+
+            std::vector<std::unique_ptr<ThreadedDatabase>> databases;
+            for (int i = 0; i < 4; i++) {
+                databases.push_back(ThreadedDatabase::establishConnection(cfg));
+            }
+            // Spread over the threads
+            Q_ASSERT((pool->connectionCounts() == std::vector<int> { 2, 2 }));
+
+            for (auto &db : databases) {
+                co_await db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)");
+                co_await db->execute("INSERT INTO test (data) VALUES (?)", "Hello World");
+            }
+            for (auto &db : databases) {
+                const auto rows = co_await db->getResults<TestDefault>("SELECT * FROM test");
+                Q_ASSERT(rows.size() == 1);
+            }
+
+            // The threads keep running for the remaining connections
+            databases.erase(databases.begin(), databases.begin() + 2);
+            Q_ASSERT((pool->connectionCounts() == std::vector<int> { 1, 1 }));
+            const auto rows = co_await databases.front()->getResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(rows.size() == 1);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testShardedDatabase() {
+        QTemporaryDir migrations;
+        QDir(migrations.path()).mkdir(QStringLiteral("2022-01-01-000000_init"));
+        QFile up(migrations.filePath(QStringLiteral("2022-01-01-000000_init/up.sql")));
+        up.open(QIODevice::WriteOnly);
+        up.write("CREATE TABLE test (id INTEGER PRIMARY KEY NOT NULL, data TEXT)");
+        up.close();
+
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished, &migrations]() -> QCoro::Task<> {
+            DatabaseConfiguration cfg;
+            cfg.setDatabaseName(":memory:");
+            cfg.setType(DATABASE_TYPE_SQLITE);
+            auto db = ShardedDatabase::establishConnections({ cfg, cfg, cfg });
+            Q_ASSERT(db->shardCount() == 3);
+            co_await db->runMigrations(migrations.path());
+
+            for (int id = 1; id <= 20; id++) {
+                co_await db->execute(id, "INSERT INTO test (id, data) VALUES (?, ?)", id, QString::number(id));
+            }
+
+            // Rows are found on the shard of their key
+            const auto row = co_await db->getResult<TestDefault>(7, "SELECT * FROM test WHERE id = ?", 7);
+            Q_ASSERT(row && row->data == QStringLiteral("7"));
+            const auto count = co_await db->shard(db->shardIndex(7)).getResult<SingleValue<int>>("SELECT count(*) FROM test");
+            Q_ASSERT(count && count->value < 20);
+
+            auto rows = co_await db->getResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(rows.size() == 20);
+
+            // Merged in order, and limited
+            MergeOptions<TestDefault> options;
+            options.lessThan = [](const TestDefault &left, const TestDefault &right) {
+                return left.id > right.id;
+            };
+            options.limit = 5;
+            rows = co_await db->getResults<TestDefault>(options, "SELECT * FROM test WHERE id > ? ORDER BY id DESC LIMIT 5", 2);
+            Q_ASSERT(rows.size() == 5);
+            for (int i = 0; i < 5; i++) {
+                Q_ASSERT(rows[i].id == 20 - i);
+            }
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testShardedDatabaseFullQueue() {
+        DatabaseConfiguration cfg;
+        cfg.setDatabaseName(":memory:");
+        cfg.setType(DATABASE_TYPE_SQLITE);
+        cfg.setMaxQueuedJobs(1);
+        cfg.setQueueFullPolicy(QueueFullPolicy::Fail);
+        auto db = ShardedDatabase::establishConnections({ cfg, cfg });
+        for (std::size_t i = 0; i < db->shardCount(); i++) {
+            db->shard(i).execute("CREATE TABLE test (id INTEGER PRIMARY KEY NOT NULL, data TEXT)").waitForFinished();
+        }
+        QVERIFY(QTest::qWaitFor([&db]() {
+            return db->shard(0).queueStatistics().depth == 0 && db->shard(1).queueStatistics().depth == 0;
+        }));
+
+        // The first shard is busy, so it rejects its part
+        auto busy = db->shard(0).transaction([](Transaction &) {
+            QThread::msleep(200);
+        });
+        auto rows = db->getResults<TestDefault>("SELECT * FROM test");
+        QVERIFY(rows.isCanceled());
+        QVERIFY(rows.isFinished());
+        auto migrations = db->runMigrations(QStringLiteral("does-not-exist"));
+        QVERIFY(migrations.isCanceled());
+        QVERIFY(migrations.isFinished());
+
+        busy.waitForFinished();
+        QVERIFY(QTest::qWaitFor([&db]() {
+            return db->shard(0).queueStatistics().depth == 0 && db->shard(1).queueStatistics().depth == 0;
+        }));
+        rows = db->getResults<TestDefault>("SELECT * FROM test");
+        rows.waitForFinished();
+        QVERIFY(!rows.isCanceled());
+        QVERIFY(rows.result().empty());
+    }
+
+    void testLiveQuery() {
+        DatabaseConfiguration cfg;
+        cfg.setDatabaseName(":memory:");
+        cfg.setType(DATABASE_TYPE_SQLITE);
+        auto db = ThreadedDatabase::establishConnection(cfg);
+        db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)").waitForFinished();
+        db->execute("CREATE TABLE other (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL)").waitForFinished();
+
+        auto live = db->watch<TestDefault>("SELECT * FROM test");
+        live->setDebounceInterval(std::chrono::milliseconds(0));
+        int changes = 0;
+        connect(live.get(), &LiveQueryBase::resultsChanged, this, [&changes]() {
+            changes++;
+        });
+
+        // The initial results
+        QVERIFY(QTest::qWaitFor([&changes]() { return changes == 1; }));
+        QVERIFY(live->results().empty());
+
+        db->execute("INSERT INTO test (data) VALUES (?)", "Hello World");
+        // Needs the SQLite library of the driver
+        if (!QTest::qWaitFor([&changes]() { return changes == 2; }, 2000)) {
+            QSKIP("The SQLite driver uses a different SQLite library");
+        }
+        QVERIFY(live->results().size() == 1);
+        QVERIFY(live->results().front().data == QStringLiteral("Hello World"));
+
+        // Writing to a different table doesn't run the query again
+        db->execute("INSERT INTO other DEFAULT VALUES").waitForFinished();
+        db->execute("DELETE FROM test").waitForFinished();
+        QVERIFY(QTest::qWaitFor([&changes]() { return changes == 3; }));
+        QVERIFY(live->results().empty());
+        QTest::qWait(100);
+        QVERIFY(changes == 3);
+    }
+
+    void testPreparedQueryCache() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            DatabaseConfiguration cfg;
+            cfg.setDatabaseName(":memory:");
+            cfg.setType(DATABASE_TYPE_SQLITE);
+            cfg.setPreparedQueryCacheSize(2);
+            auto db = ThreadedDatabase::establishConnection(cfg);
+
+            co_await db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)");
+            co_await db->execute("INSERT INTO test (data) VALUES (?)", "Hello World");
+            co_await db->execute("INSERT INTO test (data) VALUES (?)", "FutureSQL");
+
+            auto statistics = db->preparedQueryCacheStatistics();
+            Q_ASSERT(statistics.hits == 1);
+            Q_ASSERT(statistics.misses == 2);
+            Q_ASSERT(statistics.size == 2);
+
+            co_await db->getResults<TestDefault>("SELECT * FROM test");
+            statistics = db->preparedQueryCacheStatistics();
+            Q_ASSERT(statistics.evictions == 1);
+            Q_ASSERT(statistics.size == 2);
+
+            db->clearPreparedQueryCache();
+            co_await db->getResults<TestDefault>("SELECT * FROM test");
+            statistics = db->preparedQueryCacheStatistics();
+            Q_ASSERT(statistics.misses == 4);
+            Q_ASSERT(statistics.size == 1);
+
+            // Queries known at compile time share the cache
+            using InsertTest = Query<"INSERT INTO test (data) VALUES (?)">;
+            co_await db->execute(InsertTest {}, "Query");
+            co_await db->execute(InsertTest {}, "Query");
+            co_await db->execute("DELETE FROM test WHERE data = ?", "Query");
+            statistics = db->preparedQueryCacheStatistics();
+            Q_ASSERT(statistics.hits == 2);
+            Q_ASSERT(statistics.evictions == 2);
+            Q_ASSERT(statistics.size == 2);
+
+            // Zero disables the cache for them as well
+            cfg.setPreparedQueryCacheSize(0);
+            db = ThreadedDatabase::establishConnection(cfg);
+            co_await db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)");
+            co_await db->execute(InsertTest {}, "Query");
+            co_await db->execute(InsertTest {}, "Query");
+            statistics = db->preparedQueryCacheStatistics();
+            Q_ASSERT(statistics.hits == 0);
+            Q_ASSERT(statistics.size == 0);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testRegisteredQuery() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+
+            using InsertTest = Query<"INSERT INTO test (data) VALUES (?)">;
+            static_assert(InsertTest::placeholderCount == 1);
+            static_assert(Query<"SELECT * FROM test WHERE data = '?' AND id = :id">::placeholderCount == -1);
+            // Placeholders in comments don't count
+            static_assert(Query<"SELECT * FROM test -- WHERE id = :id\nWHERE data = ?">::placeholderCount == 1);
+            static_assert(Query<"SELECT * FROM test /* WHERE id = ? */ WHERE data = ?">::placeholderCount == 1);
+            static_assert(Query<"SELECT * FROM test /* ? */ WHERE id = ? -- ?">::acceptsArgumentCount(1));
+
+            co_await db->execute(InsertTest {}, "FutureSQL");
+            co_await db->execute(InsertTest {}, "Query");
+
+            auto list = co_await db->getResults<TestDefault>(Query<"SELECT * FROM test WHERE id > ? ORDER BY id ASC"> {}, 1);
+            Q_ASSERT(list.size() == 2);
+            Q_ASSERT(list.at(1).data == "Query");
+
+            const auto statistics = db->preparedQueryCacheStatistics();
+            Q_ASSERT(statistics.hits == 1);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testTransaction() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+
+            const bool committed = co_await db->transaction([](Transaction &transaction) {
+                transaction.execute("INSERT INTO test (data) VALUES (?)", "FutureSQL");
+                transaction.execute("INSERT INTO test (data) VALUES (?)", "Transaction");
+            });
+            Q_ASSERT(committed);
+
+            // A failing query rolls back the whole transaction
+            const bool rolledBack = co_await db->transaction([](Transaction &transaction) {
+                transaction.execute("INSERT INTO test (data) VALUES (?)", "Rolled back");
+                transaction.execute("INSERT INTO nonexistent (data) VALUES (?)", "Rolled back");
+            });
+            Q_ASSERT(!rolledBack);
+
+            const auto count = co_await db->transaction([](Transaction &transaction) {
+                return transaction.getResults<TestDefault>("SELECT * FROM test").size();
+            });
+            Q_ASSERT(count == 3);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testGroupCommit() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            DatabaseConfiguration cfg;
+            cfg.setDatabaseName(":memory:");
+            cfg.setType(DATABASE_TYPE_SQLITE);
+            cfg.setGroupCommitWindow(std::chrono::milliseconds(5));
+            auto db = ThreadedDatabase::establishConnection(cfg);
+
+            co_await db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT NOT NULL)");
+
+            auto first = db->execute("INSERT INTO test (data) VALUES (?)", "Hello World");
+            auto failing = db->execute("INSERT INTO test (data) VALUES (NULL)");
+            auto second = db->execute("INSERT INTO test (data) VALUES (?)", "FutureSQL");
+            co_await first;
+            co_await failing;
+            co_await second;
+
+            // The failing statement must not have affected the others
+            auto list = co_await db->getResults<TestDefault>("SELECT * FROM test ORDER BY id ASC");
+            Q_ASSERT(list.size() == 2);
+            Q_ASSERT(list.at(1).data == "FutureSQL");
+
+            // Transactions still work while group commit is enabled
+            const bool committed = co_await db->transaction([](Transaction &transaction) {
+                transaction.execute("INSERT INTO test (data) VALUES (?)", "Transaction");
+            });
+            Q_ASSERT(committed);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testPriorities() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+
+            // Keep the database thread busy, so both of the next queries are queued
+            auto busy = db->transaction([](Transaction &) {
+                QThread::msleep(100);
+            });
+            auto background = ThreadedDatabase::withPriority(QueryPriority::Background, [&] {
+                return db->execute("INSERT INTO test (data) VALUES (?)", "Background");
+            });
+            auto interactive = ThreadedDatabase::withPriority(QueryPriority::Interactive, [&] {
+                return db->getResults<TestDefault>("SELECT * FROM test");
+            });
+            co_await busy;
+            co_await background;
+            // The interactive query overtook the background query that was submitted before it
+            const auto list = co_await interactive;
+            Q_ASSERT(list.size() == 1);
+
+            const auto statistics = db->queueStatistics();
+            Q_ASSERT(statistics.lane(QueryPriority::Background).jobs == 1);
+            // The connection is established with interactive priority
+            Q_ASSERT(statistics.lane(QueryPriority::Interactive).jobs == 2);
+            Q_ASSERT(statistics.lane(QueryPriority::Normal).jobs == 3);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testCancellation() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+
+            // Keep the database thread busy, so the next query stays in the queue
+            auto busy = db->transaction([](Transaction &) {
+                QThread::msleep(100);
+            });
+            auto canceled = db->execute("INSERT INTO test (data) VALUES (?)", "Canceled");
+            canceled.cancel();
+            co_await busy;
+
+            auto list = co_await db->getResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(canceled.isFinished());
+            Q_ASSERT(list.size() == 1);
+
+            // A transaction that is canceled while it runs is rolled back
+            QFuture<bool> running;
+            QSemaphore submitted;
+            running = db->transaction([&](Transaction &transaction) {
+                transaction.execute("INSERT INTO test (data) VALUES (?)", "Canceled");
+                submitted.acquire();
+                running.cancel();
+            });
+            submitted.release();
+            list = co_await db->getResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(running.isCanceled());
+            Q_ASSERT(list.size() == 1);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testStatistics() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            std::atomic_int observed = 0;
+            DatabaseConfiguration cfg;
+            cfg.setDatabaseName(":memory:");
+            cfg.setType(DATABASE_TYPE_SQLITE);
+            cfg.setCollectStatistics(true);
+            cfg.setQueryObserver([&observed](const QueryTiming &) {
+                observed++;
+            });
+            auto db = ThreadedDatabase::establishConnection(cfg);
+
+            co_await db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)");
+            co_await db->execute("INSERT INTO test (data) VALUES ('Hello')");
+            co_await db->execute("INSERT INTO test (data) VALUES ('World')");
+            co_await db->getResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(observed == 4);
+
+            // Queries that only differ in their literals are counted together
+            const auto statistics = db->statistics();
+            Q_ASSERT(statistics.size() == 3);
+            const auto insert = std::ranges::find(statistics, QStringLiteral("INSERT INTO test (data) VALUES (?)"), &QueryStatistics::sql);
+            Q_ASSERT(insert != statistics.end());
+            Q_ASSERT(insert->count == 2);
+            Q_ASSERT(insert->execution.count == 2);
+
+            const auto select = std::ranges::find(statistics, QStringLiteral("SELECT * FROM test"), &QueryStatistics::sql);
+            Q_ASSERT(select != statistics.end());
+            Q_ASSERT(select->rows == 2);
+            Q_ASSERT(select->failures == 0);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testSlowQueries() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            DatabaseConfiguration cfg;
+            cfg.setDatabaseName(":memory:");
+            cfg.setType(DATABASE_TYPE_SQLITE);
+            // Every query is slow
+            cfg.setSlowQueryThreshold(std::chrono::milliseconds(-1));
+            cfg.setSlowQueryLogSize(3);
+            auto db = ThreadedDatabase::establishConnection(cfg);
+
+            co_await db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)");
+            co_await db->execute("INSERT INTO test (data) VALUES (?)", "Hello World");
+            co_await db->getResults<TestDefault>("SELECT * FROM test WHERE data = ?", "Hello World");
+            co_await db->getResults<TestDefault>("SELECT * FROM test WHERE data = ?", "Hello World");
+
+            // Only the most recent queries are kept
+            const auto slowQueries = db->slowQueries();
+            Q_ASSERT(slowQueries.size() == 3);
+            Q_ASSERT(slowQueries[0].sql == QStringLiteral("INSERT INTO test (data) VALUES (?)"));
+            Q_ASSERT(slowQueries[0].parameterTypes.size() == 1);
+
+            // The plan is only captured the first time
+            Q_ASSERT(slowQueries[1].rows == 1);
+            Q_ASSERT(slowQueries[1].queryPlan.contains(QStringLiteral("test")));
+            Q_ASSERT(slowQueries[2].queryPlan.isEmpty());
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testConnectionSettings() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            QTemporaryDir dir;
+            DatabaseConfiguration cfg;
+            cfg.setDatabaseName(dir.filePath("settings.sqlite"));
+            cfg.setType(DATABASE_TYPE_SQLITE);
+            cfg.setJournalMode(SqliteJournalMode::Wal);
+            cfg.setSynchronous(SqliteSynchronous::Normal);
+            cfg.setBusyTimeout(std::chrono::milliseconds(1234));
+            cfg.setCacheSize(-4000);
+            cfg.setInitStatements({QStringLiteral("PRAGMA foreign_keys = ON")});
+            auto db = ThreadedDatabase::establishConnection(cfg);
+
+            // The settings are applied before the first query
+            auto journalMode = co_await db->getResult<SingleValue<QString>>("PRAGMA journal_mode");
+            Q_ASSERT(journalMode->value == QStringLiteral("wal"));
+            auto synchronous = co_await db->getResult<SingleValue<int>>("PRAGMA synchronous");
+            Q_ASSERT(synchronous->value == 1);
+            auto busyTimeout = co_await db->getResult<SingleValue<int>>("PRAGMA busy_timeout");
+            Q_ASSERT(busyTimeout->value == 1234);
+            auto cacheSize = co_await db->getResult<SingleValue<int>>("PRAGMA cache_size");
+            Q_ASSERT(cacheSize->value == -4000);
+            auto foreignKeys = co_await db->getResult<SingleValue<int>>("PRAGMA foreign_keys");
+            Q_ASSERT(foreignKeys->value == 1);
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+    }
+
+    void testMoveOnlyResults() {
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+        QSKIP("QFuture needs copyable results in Qt 5");
+#else
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            auto db = co_await initDatabase();
+
+            auto future = db->getResults<TestMoveOnly>("SELECT * FROM test");
+            future.waitForFinished();
+            const auto list = future.takeResult();
+            Q_ASSERT(list.size() == 1);
+            Q_ASSERT(*list.front().data == QStringLiteral("Hello World"));
+
+            finished = true;
+        });
+        while (!finished) {
+            QCoreApplication::processEvents();
+        }
+#endif
+    }
+
+    void testReadConnections() {
+        bool finished = false;
+        QMetaObject::invokeMethod(this, [&finished]() -> QCoro::Task<> {
+            QTemporaryDir dir;
+            DatabaseConfiguration cfg;
+            cfg.setDatabaseName(dir.filePath("readconnections.sqlite"));
+            cfg.setType(DATABASE_TYPE_SQLITE);
+            cfg.setReadConnectionCount(2);
+            cfg.setJournalMode(SqliteJournalMode::Wal);
+            auto db = ThreadedDatabase::establishConnection(cfg);
+
+            co_await db->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)");
+            co_await db->execute("INSERT INTO test (data) VALUES (?)", "Hello World");
+
+            auto list = co_await db->getResults<TestDefault>("SELECT * FROM test");
+            Q_ASSERT(list.size() == 1);
+            auto opt = co_await db->getResult<TestDefault>("SELECT * FROM test WHERE data = ?", "Hello World");
+            Q_ASSERT(opt.has_value());
+
+            // Databases that are private to a connection have no read connections, so reads see the writes
+            for (const QString &name : { QString(), QStringLiteral("file::memory:"), QStringLiteral("file:readconnections?mode=memory") }) {
+                DatabaseConfiguration privateCfg;
+                privateCfg.setDatabaseName(name);
+                privateCfg.setType(DATABASE_TYPE_SQLITE);
+                privateCfg.setConnectOptions(QStringLiteral("QSQLITE_OPEN_URI"));
+                privateCfg.setReadConnectionCount(2);
+                auto privateDb = ThreadedDatabase::establishConnection(privateCfg);
+
+                co_await privateDb->execute("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, data TEXT)");
+                co_await privateDb->execute("INSERT INTO test (data) VALUES (?)", "Hello World");
+                list = co_await privateDb->getResults<TestDefault>("SELECT * FROM test");
+                Q_ASSERT(list.size() == 1);
+            }
+
             finished = true;
         });
         while (!finished) {